@@ -0,0 +1,86 @@
+/* The AVL balancing shared by bstree and ordered_map, for any node type with 'left', 'right', 'parent' and
+ * 'height' members (a leaf has height 1).
+ * 'Update' recomputes what a node derives from its children, its height at least; bstree keeps subtree sizes
+ * there too. The tree is rebalanced from the parent of the changed node up to the root, by the parent pointers.
+ */
+#pragma once
+#include <algorithm>
+
+namespace impl
+{
+template <class Node> struct avl_update_height
+{
+    void operator()(Node *p) const
+    {
+        p->height = std::max(p->left ? p->left->height : 0, p->right ? p->right->height : 0) + 1;
+    }
+};
+
+template <class Node, class Update = avl_update_height<Node>> struct avl_core
+{
+    static int height(const Node *p)
+    {
+        return p ? p->height : 0;
+    }
+
+    // Put 'v' where 'u' is, under u->parent or at 'root'. 'v' may be nullptr.
+    static void transplant(Node *&root, Node *u, Node *v)
+    {
+        if (u->parent == nullptr)
+            root = v;
+        else if (u == u->parent->left)
+            u->parent->left = v;
+        else
+            u->parent->right = v;
+        if (v)
+            v->parent = u->parent;
+    }
+
+    static Node *rotate_right(Node *&root, Node *p)
+    {
+        Node *l = p->left;
+        p->left = l->right;
+        if (l->right)
+            l->right->parent = p;
+        transplant(root, p, l);
+        l->right = p, p->parent = l;
+        Update()(p), Update()(l);
+        return l;
+    }
+
+    static Node *rotate_left(Node *&root, Node *p)
+    {
+        Node *r = p->right;
+        p->right = r->left;
+        if (r->left)
+            r->left->parent = p;
+        transplant(root, p, r);
+        r->left = p, p->parent = r;
+        Update()(p), Update()(r);
+        return r;
+    }
+
+    // Restore the AVL property (and 'Update') from 'p' up to the root, after a node below 'p' was linked or
+    // unlinked. The subtrees of 'p' must be AVL trees.
+    static void rebalance(Node *&root, Node *p)
+    {
+        for (; p; p = p->parent)
+        {
+            Update()(p);
+            int diff = height(p->left) - height(p->right);
+            if (diff > 1)
+            {
+                if (height(p->left->left) < height(p->left->right))
+                    rotate_left(root, p->left);
+                p = rotate_right(root, p);
+            }
+            else if (diff < -1)
+            {
+                if (height(p->right->right) < height(p->right->left))
+                    rotate_right(root, p->right);
+                p = rotate_left(root, p);
+            }
+        }
+    }
+};
+} // namespace impl
@@ -0,0 +1,425 @@
+/* A B+ tree of ints with the set API of bstree, laid out for the cache rather than one key per node:
+ * - an inner node keeps its keys in 2 cache lines, a leaf node is 4 cache lines in all;
+ * - keys are searched with SSE2, 4 at a time, by counting the keys less than the one looked for. The unused
+ *   slots hold INT_MAX, which is never less than anything, so the count needs no masking;
+ * - all keys live in the leaves, which are linked, so 'scan' and 'flattern' walk leaves and skip the inner levels.
+ * A separator in an inner node is an upper bound of its left subtree: child[i] holds keys in (keys[i-1], keys[i]].
+ * Nodes are at least half full, except the root.
+ */
+#pragma once
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace impl
+{
+class bptree
+{
+  public:
+    static constexpr int cache_line = 64;
+    static constexpr int inner_cap = 2 * cache_line / sizeof(int); // keys, 32
+    static constexpr int leaf_cap = (4 * cache_line - 16) / sizeof(int); // 60, leaving room for 'n' and 'next'
+
+  private:
+    struct alignas(cache_line) inner_node
+    {
+        int keys[inner_cap];
+        int n; // the number of keys, there are n + 1 children
+        void *child[inner_cap + 1];
+    };
+
+    struct alignas(cache_line) leaf_node
+    {
+        int keys[leaf_cap];
+        int n;
+        leaf_node *next;
+    };
+
+    static_assert(sizeof(leaf_node) == 4 * cache_line, "a leaf should be 4 cache lines");
+    static_assert(inner_cap % 4 == 0 && leaf_cap % 4 == 0, "keys are compared in groups of 4");
+
+    // The number of keys less than 'x' among the first 'n', the slots up to a multiple of 4 must hold INT_MAX
+    static int count_less(const int *keys, int n, int x)
+    {
+#ifdef __SSE2__
+        __m128i vx = _mm_set1_epi32(x);
+        int cnt = 0;
+        for (int i = 0; i < n; i += 4)
+        {
+            __m128i lt = _mm_cmplt_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(keys + i)), vx);
+            cnt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+        }
+        return cnt;
+#else
+        return std::lower_bound(keys, keys + n, x) - keys;
+#endif
+    }
+
+    template <class Node> static Node *make_node()
+    {
+        Node *p = new Node(); // zeroed, so a leaf has no next
+        std::fill(std::begin(p->keys), std::end(p->keys), INT_MAX);
+        p->n = 0;
+        return p;
+    }
+
+    // Shift keys[i, n) right by one, 'n' excludes the new key
+    static void open_gap(int *keys, int n, int i)
+    {
+        std::copy_backward(keys + i, keys + n, keys + n + 1);
+    }
+
+    // Remove keys[i] of 'n', and restore the padding
+    static void close_gap(int *keys, int n, int i)
+    {
+        std::copy(keys + i + 1, keys + n, keys + i);
+        keys[n - 1] = INT_MAX;
+    }
+
+    void *root;
+    int height; // 1 when the root is a leaf, 0 when empty
+    size_t count;
+
+  public:
+    bptree() : root(nullptr), height(0), count(0)
+    {
+    }
+
+    bptree(const bptree &) = delete;
+    bptree &operator=(const bptree &) = delete;
+
+    ~bptree()
+    {
+        clear();
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    void clear()
+    {
+        if (root)
+            destroy(root, height);
+        root = nullptr, height = 0, count = 0;
+    }
+
+    bool search(int x) const
+    {
+        if (root == nullptr)
+            return false;
+        const leaf_node *leaf = find_leaf(x);
+        int i = count_less(leaf->keys, leaf->n, x);
+        return i < leaf->n && leaf->keys[i] == x;
+    }
+
+    // return false if 'x' has existed in the tree
+    bool insert(int x)
+    {
+        if (root == nullptr)
+            root = make_node<leaf_node>(), height = 1;
+
+        split_t split;
+        if (!insert(root, height, x, split))
+            return false;
+        if (split.right)
+        {
+            auto p = make_node<inner_node>();
+            p->keys[0] = split.key, p->n = 1;
+            p->child[0] = root, p->child[1] = split.right;
+            root = p, height++;
+        }
+        count++;
+        return true;
+    }
+
+    // return false if 'x' does not exist
+    bool remove(int x)
+    {
+        if (root == nullptr || !remove(root, height, x))
+            return false;
+        count--;
+
+        // shrink from the top: an inner root with one child, or an empty leaf root
+        if (height > 1 && static_cast<inner_node *>(root)->n == 0)
+        {
+            auto p = static_cast<inner_node *>(root);
+            root = p->child[0], height--;
+            delete p;
+        }
+        else if (height == 1 && static_cast<leaf_node *>(root)->n == 0)
+        {
+            delete static_cast<leaf_node *>(root);
+            root = nullptr, height = 0;
+        }
+        return true;
+    }
+
+    // Call f(key) for the keys in [lo, hi] in order, following the leaf links
+    template <class F> void scan(int lo, int hi, F &&f) const
+    {
+        if (root == nullptr || lo > hi)
+            return;
+        const leaf_node *leaf = find_leaf(lo);
+        for (int i = count_less(leaf->keys, leaf->n, lo); leaf; leaf = leaf->next, i = 0)
+        {
+            for (; i < leaf->n; ++i)
+            {
+                if (leaf->keys[i] > hi)
+                    return;
+                f(leaf->keys[i]);
+            }
+        }
+    }
+
+    // Get the sorted sequence, leaf by leaf
+    std::vector<int> flattern() const
+    {
+        std::vector<int> seq;
+        seq.reserve(count);
+        if (root == nullptr)
+            return seq;
+        void *p = root;
+        for (int h = height; h > 1; --h)
+            p = static_cast<inner_node *>(p)->child[0];
+        for (auto leaf = static_cast<const leaf_node *>(p); leaf; leaf = leaf->next)
+            seq.insert(seq.end(), leaf->keys, leaf->keys + leaf->n);
+        return seq;
+    }
+
+    // The number of levels
+    int depth() const
+    {
+        return height;
+    }
+
+  private:
+    const leaf_node *find_leaf(int x) const
+    {
+        const void *p = root;
+        for (int h = height; h > 1; --h)
+        {
+            auto in = static_cast<const inner_node *>(p);
+            p = in->child[count_less(in->keys, in->n, x)];
+        }
+        return static_cast<const leaf_node *>(p);
+    }
+
+    static void destroy(void *p, int h)
+    {
+        if (h == 1)
+        {
+            delete static_cast<leaf_node *>(p);
+            return;
+        }
+        auto in = static_cast<inner_node *>(p);
+        for (int i = 0; i <= in->n; ++i)
+            destroy(in->child[i], h - 1);
+        delete in;
+    }
+
+    // A node which split, 'right' is the new right half and 'key' bounds the left half
+    struct split_t
+    {
+        int key;
+        void *right = nullptr;
+    };
+
+    // The recursion is as deep as the tree, a handful of levels
+    bool insert(void *p, int h, int x, split_t &split)
+    {
+        if (h == 1)
+        {
+            auto leaf = static_cast<leaf_node *>(p);
+            int i = count_less(leaf->keys, leaf->n, x);
+            if (i < leaf->n && leaf->keys[i] == x)
+                return false;
+            if (leaf->n < leaf_cap)
+            {
+                open_gap(leaf->keys, leaf->n, i);
+                leaf->keys[i] = x, leaf->n++;
+                return true;
+            }
+
+            // split a full leaf in halves, then insert into the half 'x' belongs to
+            auto right = make_node<leaf_node>();
+            int mid = leaf_cap / 2;
+            std::copy(leaf->keys + mid, leaf->keys + leaf_cap, right->keys);
+            std::fill(leaf->keys + mid, leaf->keys + leaf_cap, INT_MAX);
+            right->n = leaf_cap - mid, leaf->n = mid;
+            right->next = leaf->next, leaf->next = right;
+
+            auto half = (i <= mid) ? leaf : right;
+            i = (i <= mid) ? i : i - mid;
+            open_gap(half->keys, half->n, i);
+            half->keys[i] = x, half->n++;
+            split = {leaf->keys[leaf->n - 1], right};
+            return true;
+        }
+
+        auto in = static_cast<inner_node *>(p);
+        int i = count_less(in->keys, in->n, x);
+        split_t below;
+        if (!insert(in->child[i], h - 1, x, below))
+            return false;
+        if (below.right == nullptr)
+            return true;
+
+        if (in->n < inner_cap)
+        {
+            insert_child(in, i, below);
+            return true;
+        }
+
+        // Split a full inner node. With the new key there are inner_cap + 1, the middle one moves up and each half
+        // keeps inner_cap / 2: the new key itself when it lands in the middle, otherwise keys[mid] from the side it
+        // does not go to.
+        auto right = make_node<inner_node>();
+        int mid = inner_cap / 2;
+        if (i == mid)
+        {
+            split = {below.key, right};
+            right->n = inner_cap - mid;
+            std::copy(in->keys + mid, in->keys + inner_cap, right->keys);
+            right->child[0] = below.right;
+            std::copy(in->child + mid + 1, in->child + inner_cap + 1, right->child + 1);
+            std::fill(in->keys + mid, in->keys + inner_cap, INT_MAX);
+            in->n = mid;
+            return true;
+        }
+
+        if (i < mid)
+            mid--;
+        split = {in->keys[mid], right};
+        right->n = inner_cap - mid - 1;
+        std::copy(in->keys + mid + 1, in->keys + inner_cap, right->keys);
+        std::copy(in->child + mid + 1, in->child + inner_cap + 1, right->child);
+        std::fill(in->keys + mid, in->keys + inner_cap, INT_MAX);
+        in->n = mid;
+
+        if (i <= mid)
+            insert_child(in, i, below);
+        else
+            insert_child(right, i - mid - 1, below);
+        return true;
+    }
+
+    // child[i] of 'in' split into child[i] and 'below.right'
+    static void insert_child(inner_node *in, int i, const split_t &below)
+    {
+        open_gap(in->keys, in->n, i);
+        std::copy_backward(in->child + i + 1, in->child + in->n + 1, in->child + in->n + 2);
+        in->keys[i] = below.key, in->child[i + 1] = below.right;
+        in->n++;
+    }
+
+    bool remove(void *p, int h, int x)
+    {
+        if (h == 1)
+        {
+            auto leaf = static_cast<leaf_node *>(p);
+            int i = count_less(leaf->keys, leaf->n, x);
+            if (i == leaf->n || leaf->keys[i] != x)
+                return false;
+            // a stale separator above is still an upper bound, it need not change
+            close_gap(leaf->keys, leaf->n, i);
+            leaf->n--;
+            return true;
+        }
+
+        auto in = static_cast<inner_node *>(p);
+        int i = count_less(in->keys, in->n, x);
+        if (!remove(in->child[i], h - 1, x))
+            return false;
+
+        bool under = (h == 2) ? static_cast<leaf_node *>(in->child[i])->n < leaf_cap / 2
+                              : static_cast<inner_node *>(in->child[i])->n < inner_cap / 2;
+        if (under)
+        {
+            int j = (i > 0) ? i - 1 : 0; // fix the pair child[j], child[j + 1]
+            if (h == 2)
+                fix_leaves(in, j);
+            else
+                fix_inners(in, j);
+        }
+        return true;
+    }
+
+    // Drop keys[j] and child[j + 1] of 'in', after child[j + 1] merged into child[j]
+    static void drop_child(inner_node *in, int j)
+    {
+        std::copy(in->child + j + 2, in->child + in->n + 1, in->child + j + 1);
+        close_gap(in->keys, in->n, j);
+        in->n--;
+    }
+
+    // One of the leaves child[j], child[j + 1] is under half full: merge them, or move a key over
+    static void fix_leaves(inner_node *in, int j)
+    {
+        auto l = static_cast<leaf_node *>(in->child[j]), r = static_cast<leaf_node *>(in->child[j + 1]);
+        if (l->n + r->n <= leaf_cap)
+        {
+            std::copy(r->keys, r->keys + r->n, l->keys + l->n);
+            l->n += r->n, l->next = r->next;
+            delete r;
+            drop_child(in, j);
+            return;
+        }
+
+        if (l->n < r->n)
+        {
+            l->keys[l->n++] = r->keys[0];
+            close_gap(r->keys, r->n, 0);
+            r->n--;
+        }
+        else
+        {
+            open_gap(r->keys, r->n, 0);
+            r->keys[0] = l->keys[l->n - 1], r->n++;
+            l->keys[--l->n] = INT_MAX;
+        }
+        in->keys[j] = l->keys[l->n - 1];
+    }
+
+    // The same for inner nodes, where the separator keys[j] moves down into the merged node, or rotates
+    static void fix_inners(inner_node *in, int j)
+    {
+        auto l = static_cast<inner_node *>(in->child[j]), r = static_cast<inner_node *>(in->child[j + 1]);
+        if (l->n + r->n + 1 <= inner_cap)
+        {
+            l->keys[l->n] = in->keys[j];
+            std::copy(r->keys, r->keys + r->n, l->keys + l->n + 1);
+            std::copy(r->child, r->child + r->n + 1, l->child + l->n + 1);
+            l->n += r->n + 1;
+            delete r;
+            drop_child(in, j);
+            return;
+        }
+
+        if (l->n < r->n)
+        {
+            l->keys[l->n] = in->keys[j], l->child[l->n + 1] = r->child[0];
+            l->n++;
+            in->keys[j] = r->keys[0];
+            std::copy(r->child + 1, r->child + r->n + 1, r->child);
+            close_gap(r->keys, r->n, 0);
+            r->n--;
+        }
+        else
+        {
+            open_gap(r->keys, r->n, 0);
+            std::copy_backward(r->child, r->child + r->n + 1, r->child + r->n + 2);
+            r->keys[0] = in->keys[j], r->child[0] = l->child[l->n];
+            r->n++;
+            in->keys[j] = l->keys[l->n - 1];
+            l->keys[--l->n] = INT_MAX;
+        }
+    }
+};
+} // namespace impl
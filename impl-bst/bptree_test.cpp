@@ -0,0 +1,111 @@
+#include "bptree.hpp"
+#include "bst.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <assert.h>
+
+// Random operations, checked against std::set
+void test_against_std_set()
+{
+    constexpr int N = 200000, range = 50000;
+    impl::bptree tree;
+    std::set<int> ref;
+
+    for (int i = 0; i < N; ++i)
+    {
+        // insert more than remove for the first half, then the other way round
+        int k = random() % range, op = random() % 10;
+        bool ins = (i < N / 2) ? op < 7 : op < 3;
+        if (ins)
+            assert(tree.insert(k) == ref.insert(k).second);
+        else
+            assert(tree.remove(k) == (ref.erase(k) == 1));
+        assert(tree.search(k) == (ref.count(k) == 1));
+        assert(tree.size() == ref.size());
+        if (i % 10000 == 0)
+            assert(tree.flattern() == std::vector<int>(ref.begin(), ref.end()));
+    }
+    assert(tree.flattern() == std::vector<int>(ref.begin(), ref.end()));
+
+    for (int k : std::vector<int>(ref.begin(), ref.end()))
+        assert(tree.remove(k));
+    assert(tree.size() == 0 && tree.depth() == 0 && !tree.search(0));
+}
+
+// Sorted input, the extreme keys, and range scans
+void test_sorted_and_scan()
+{
+    constexpr int N = 1 << 18;
+    impl::bptree tree;
+    for (int i = 0; i < N; ++i)
+        assert(tree.insert(i * 2));
+    // half full nodes at worst: 30 keys per leaf, 17 children per inner node
+    assert(tree.depth() <= 5);
+
+    assert(tree.insert(INT_MAX) && tree.insert(INT_MIN));
+    assert(tree.search(INT_MAX) && tree.search(INT_MIN) && !tree.insert(INT_MAX));
+    assert(tree.remove(INT_MAX) && !tree.search(INT_MAX) && tree.remove(INT_MIN));
+
+    std::vector<int> got;
+    tree.scan(99, 1001, [&](int k) { got.push_back(k); });
+    assert(got.size() == 451 && got.front() == 100 && got.back() == 1000);
+    got.clear();
+    tree.scan(2 * N - 3, INT_MAX, [&](int k) { got.push_back(k); });
+    assert(got.size() == 1 && got[0] == 2 * N - 2);
+    got.clear();
+    tree.scan(5, 4, [&](int k) { got.push_back(k); });
+    assert(got.empty());
+
+    // descending removal, merging from the right
+    for (int i = N - 1; i >= 0; i -= 2)
+        assert(tree.remove(i * 2));
+    auto seq = tree.flattern();
+    assert(seq.size() == N / 2);
+    for (int i = 0; i < N / 2; ++i)
+        assert(seq[i] == i * 4);
+    tree.clear();
+    assert(tree.size() == 0 && !tree.search(0));
+}
+
+// Lookups of random keys on a big set, against the AVL bstree
+void bench_lookup(int n)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    std::vector<int> keys(n), probes(n);
+    for (auto &k : keys)
+        k = random();
+    for (int i = 0; i < n; ++i)
+        probes[i] = (i % 2) ? keys[random() % n] : (int)random();
+
+    auto run = [&](const char *name, auto &tree) {
+        auto t0 = clock::now();
+        for (int k : keys)
+            tree.insert(k);
+        auto t1 = clock::now();
+        long found = 0;
+        for (int k : probes)
+            found += tree.search(k) ? 1 : 0;
+        auto t2 = clock::now();
+        std::cout << name << ": insert " << ms(t1 - t0) << " ms, " << n << " lookups " << ms(t2 - t1) << " ms ("
+                  << ms(t2 - t1) * 1e6 / n << " ns each, " << found << " found)" << std::endl;
+    };
+    {
+        impl::bstree bst(impl::balance::avl);
+        run("bstree (avl)", bst);
+    }
+    {
+        impl::bptree bpt;
+        run("bptree      ", bpt);
+    }
+}
+
+// ./a.out 10000000 for a set far beyond the caches, it takes a minute or two
+int main(int argc, char *argv[])
+{
+    test_against_std_set();
+    test_sorted_and_scan();
+    bench_lookup(argc > 1 ? atoi(argv[1]) : 1000000);
+}
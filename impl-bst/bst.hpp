@@ -4,71 +4,347 @@
  * 3. https://leetcode.com/problems/search-in-a-binary-search-tree/
  */
 #pragma once
-#include <stack>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <utility>
 #include <vector>
 
+#include "avl_core.hpp"
+
 namespace impl
 {
 struct tree_node
 {
     int val;
-    tree_node *left, *right;
-    tree_node(int v = 0) : val(v), left(nullptr), right(nullptr)
+    int height;    // of the subtree, a leaf is 1. Only kept up to date by an AVL tree.
+    unsigned size; // the number of nodes in the subtree, for rank and select
+    tree_node *left, *right, *parent;
+    tree_node(int v = 0) : val(v), height(1), size(1), left(nullptr), right(nullptr), parent(nullptr)
     {
     }
 };
 
+/* none: a plain BST, sorted input degrades it to a list.
+ * avl: rebalanced by rotations after each insert/remove, the height stays below 1.44 * log2(n + 2).
+ */
+enum class balance
+{
+    none,
+    avl
+};
+
+/* Hands out tree_nodes from slabs owned by one tree.
+ * - Consecutive allocations are adjacent in memory, so a tree built in order is traversed in order.
+ * - Slabs double in size up to 'max_slab' nodes, a freed node goes to a free list for reuse.
+ * - 'release' frees the slabs without visiting the nodes, tree_node is trivially destructible.
+ */
+class node_pool
+{
+  public:
+    static constexpr size_t min_slab = 64, max_slab = 1 << 16;
+
+    node_pool() : next(nullptr), left(0), slab_size(0), free_list(nullptr)
+    {
+    }
+
+    node_pool(node_pool &&p) noexcept
+        : slabs(std::move(p.slabs)), next(p.next), left(p.left), slab_size(p.slab_size), free_list(p.free_list)
+    {
+        p.slabs.clear(), p.next = nullptr, p.left = 0, p.slab_size = 0, p.free_list = nullptr;
+    }
+
+    // Frees the slabs of this pool, so the nodes handed out by it are gone
+    node_pool &operator=(node_pool &&p) noexcept
+    {
+        if (this != &p)
+        {
+            release();
+            slabs.swap(p.slabs);
+            next = p.next, left = p.left, slab_size = p.slab_size, free_list = p.free_list;
+            p.next = nullptr, p.left = 0, p.slab_size = 0, p.free_list = nullptr;
+        }
+        return *this;
+    }
+
+    node_pool(const node_pool &) = delete;
+    node_pool &operator=(const node_pool &) = delete;
+
+    ~node_pool()
+    {
+        release();
+    }
+
+    tree_node *allocate(int val)
+    {
+        tree_node *p;
+        if (free_list)
+            p = free_list, free_list = free_list->left;
+        else
+        {
+            if (left == 0)
+                grow();
+            p = next++, left--;
+        }
+        return new (p) tree_node(val);
+    }
+
+    // freed nodes are linked through 'left'
+    void deallocate(tree_node *p)
+    {
+        p->left = free_list;
+        free_list = p;
+    }
+
+    void release()
+    {
+        for (auto slab : slabs)
+            ::operator delete(slab);
+        slabs.clear(), next = nullptr, left = 0, slab_size = 0, free_list = nullptr;
+    }
+
+  private:
+    void grow()
+    {
+        size_t n = slabs.empty() ? min_slab : std::min(slab_size * 2, max_slab);
+        slabs.reserve(slabs.size() + 1); // so the slab cannot leak if this throws
+        slabs.push_back(::operator new(n * sizeof(tree_node)));
+        next = static_cast<tree_node *>(slabs.back()), left = n, slab_size = n;
+    }
+
+    std::vector<void *> slabs;
+    tree_node *next;  // the unused part of the last slab
+    size_t left;      // the number of nodes in it
+    size_t slab_size; // of the last slab
+    tree_node *free_list;
+};
+
 class bstree
 {
   private:
-    // Return the root of tree after deleting key
-    tree_node *remove(tree_node *node, int val)
+    static int height(tree_node *p)
+    {
+        return p ? p->height : 0;
+    }
+
+    static unsigned size(tree_node *p)
+    {
+        return p ? p->size : 0;
+    }
+
+    static void update(tree_node *p)
+    {
+        p->height = std::max(height(p->left), height(p->right)) + 1;
+        p->size = size(p->left) + size(p->right) + 1;
+    }
+
+    struct update_fn
+    {
+        void operator()(tree_node *p) const
+        {
+            update(p);
+        }
+    };
+    using avl = avl_core<tree_node, update_fn>;
+
+    static void set_parent(tree_node *c, tree_node *p)
     {
-        if (node == nullptr)
-            return node;
+        if (c)
+            c->parent = p;
+    }
 
-        if (val > node->val)
-            node->right = remove(node->right, val);
-        else if (val < node->val)
-            node->left = remove(node->left, val);
+    // After a node below 'parent' was linked or unlinked: rebalance an AVL tree up to the root, which updates
+    // the sizes too. A plain tree only updates the sizes.
+    void fix_up(tree_node *parent)
+    {
+        if (mode == balance::avl)
+            avl::rebalance(root, parent);
         else
         {
-            // we need to delete curretn 'node'. Rather than deleting,
-            // we replace it with its precessor (or successor).
-            bool l = node->left, r = node->right;
-            if (!l && !r) // leaf node, has no precessor (or successor)
-            {
-                delete node;
-                return nullptr;
-            }
-            else if (l ^ r) // has one child
-            {
-                auto child = l ? node->left : node->right;
-                delete node;
-                return child;
-            }
-            else // has two children
-            {
-                auto successor = mostLeft(node->right);
-                node->val = successor->val;
-                node->right = remove(node->right, successor->val);
-                return node;
-            }
+            for (; parent; parent = parent->parent)
+                parent->size = size(parent->left) + size(parent->right) + 1;
         }
-        return node;
     }
-    tree_node *mostLeft(tree_node *p)
+
+    // A tree of the next 'n' values of 'it', the middle one at the root. The recursion is log2(n) deep.
+    template <class It> tree_node *build(It &it, size_t n)
     {
-        while (p->left)
+        if (n == 0)
+            return nullptr;
+        tree_node *left = build(it, n / 2);
+        tree_node *p = pool.allocate(*it);
+        ++it;
+        p->left = left;
+        p->right = build(it, n - n / 2 - 1);
+        set_parent(p->left, p), set_parent(p->right, p);
+        update(p);
+        return p;
+    }
+
+    balance mode;
+    node_pool pool;
+    size_t nr_nodes = 0;
+
+    static tree_node *leftmost(tree_node *p)
+    {
+        while (p && p->left)
             p = p->left;
         return p;
     }
 
+    static tree_node *rightmost(tree_node *p)
+    {
+        while (p && p->right)
+            p = p->right;
+        return p;
+    }
+
+    // The in-order successor by the parent pointers, nullptr after the last node
+    static tree_node *next(tree_node *p)
+    {
+        if (p->right)
+            return leftmost(p->right);
+        while (p->parent && p == p->parent->right)
+            p = p->parent;
+        return p->parent;
+    }
+
+    static tree_node *prev(tree_node *p)
+    {
+        if (p->left)
+            return rightmost(p->left);
+        while (p->parent && p == p->parent->left)
+            p = p->parent;
+        return p->parent;
+    }
+
   public:
+    /* An in-order iterator over the keys, read-only since a key decides where its node is. It needs no stack:
+     * a step follows the parent pointers, O(1) amortized over a scan. 'insert' keeps iterators valid, 'remove'
+     * invalidates them.
+     */
+    class iterator
+    {
+        friend class bstree;
+
+        tree_node *p;    // nullptr for end()
+        const bstree *t; // to step back from end()
+
+        iterator(tree_node *p, const bstree *t) : p(p), t(t)
+        {
+        }
+
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = int;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const int *;
+        using reference = const int &;
+
+        iterator() : p(nullptr), t(nullptr)
+        {
+        }
+
+        reference operator*() const
+        {
+            return p->val;
+        }
+
+        pointer operator->() const
+        {
+            return &p->val;
+        }
+
+        iterator &operator++()
+        {
+            p = next(p);
+            return *this;
+        }
+
+        iterator operator++(int)
+        {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        iterator &operator--()
+        {
+            p = p ? prev(p) : rightmost(t->root);
+            return *this;
+        }
+
+        iterator operator--(int)
+        {
+            iterator it = *this;
+            --*this;
+            return it;
+        }
+
+        friend bool operator==(const iterator &a, const iterator &b)
+        {
+            return a.p == b.p;
+        }
+
+        friend bool operator!=(const iterator &a, const iterator &b)
+        {
+            return a.p != b.p;
+        }
+    };
+
+    // [first, last) of a range query, for a range-for
+    struct range_t
+    {
+        iterator first, last;
+
+        iterator begin() const
+        {
+            return first;
+        }
+
+        iterator end() const
+        {
+            return last;
+        }
+    };
+
     tree_node *root;
-    bstree() : root(nullptr)
+    explicit bstree(balance mode = balance::none) : mode(mode), root(nullptr)
     {
     }
+
+    bstree(bstree &&t) noexcept : mode(t.mode), pool(std::move(t.pool)), nr_nodes(t.nr_nodes), root(t.root)
+    {
+        t.root = nullptr, t.nr_nodes = 0;
+    }
+
+    bstree &operator=(bstree &&t) noexcept
+    {
+        if (this != &t)
+        {
+            mode = t.mode, pool = std::move(t.pool), nr_nodes = t.nr_nodes, root = t.root;
+            t.root = nullptr, t.nr_nodes = 0;
+        }
+        return *this;
+    }
+
+    // the nodes belong to the pool
+    bstree(const bstree &) = delete;
+    bstree &operator=(const bstree &) = delete;
+
+    // Free all nodes at once, by their slabs
+    void clear()
+    {
+        pool.release();
+        root = nullptr, nr_nodes = 0;
+    }
+
+    size_t size() const
+    {
+        return nr_nodes;
+    }
+
     auto search(int val)
     {
         auto p = root;
@@ -84,55 +360,192 @@ class bstree
         return p;
     }
 
-    // return the inserted node
+    // return the inserted node, nullptr if 'val' has existed in bst
     tree_node *insert(int val)
     {
-        if (root == nullptr)
-            return (root = new tree_node(val));
-
-        tree_node *pre = nullptr, *p = root;
-        auto node = new tree_node(val);
-        while (p)
+        tree_node **link = &root, *parent = nullptr;
+        while (*link)
         {
-            pre = p;
-            if (p->val < val)
-                p = p->right;
-            else if (p->val > val)
-                p = p->left;
+            parent = *link;
+            if (parent->val < val)
+                link = &parent->right;
+            else if (parent->val > val)
+                link = &parent->left;
             else
-            {
-                // If 'val' has existed in bst
-                delete node;
                 return nullptr;
-            }
         }
-        return (val < pre->val) ? (pre->left = node) : (pre->right = node);
+
+        tree_node *node = *link = pool.allocate(val);
+        node->parent = parent;
+        nr_nodes++;
+        fix_up(parent);
+        return node;
     }
 
+    // Return the root of tree after deleting key. Iterative, so a degenerate plain tree does not overflow
+    // the stack.
     tree_node *remove(int val)
     {
-        return root = remove(root, val);
+        tree_node **link = &root;
+        while (*link && (*link)->val != val)
+            link = ((*link)->val < val) ? &(*link)->right : &(*link)->left;
+        if (*link == nullptr)
+            return root;
+
+        // we need to delete current node. If it has two children, rather than deleting it, we replace
+        // its value with its successor's, and delete the successor, which has no left child.
+        tree_node *node = *link;
+        if (node->left && node->right)
+        {
+            link = &node->right;
+            while ((*link)->left)
+                link = &(*link)->left;
+            node->val = (*link)->val;
+            node = *link;
+        }
+        tree_node *parent = node->parent;
+        *link = node->left ? node->left : node->right;
+        set_parent(*link, parent);
+        pool.deallocate(node);
+        nr_nodes--;
+        fix_up(parent);
+        return root;
     }
 
-    // Get sequence by in-order traversal
-    std::vector<int> flattern()
+    // Replace the contents with [first, last), which must be strictly increasing, in O(n) and without a
+    // comparison. The result is as balanced as possible, so it is a valid AVL tree too, and its nodes are
+    // allocated in order.
+    template <class It> void build_from_sorted(It first, It last)
+    {
+        clear();
+        nr_nodes = std::distance(first, last);
+        root = build(first, nr_nodes);
+        set_parent(root, nullptr);
+    }
+
+    template <class Range> void build_from_sorted(const Range &sorted)
+    {
+        build_from_sorted(std::begin(sorted), std::end(sorted));
+    }
+
+    // Make this tree the union of itself and 'other', in O(n + m): merge the two sequences, then rebuild
+    void merge(const bstree &other)
     {
+        auto a = flattern(), b = other.flattern();
         std::vector<int> seq;
-        std::stack<tree_node *> stk;
-        auto p = root;
+        seq.reserve(a.size() + b.size());
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(seq));
+        build_from_sorted(seq);
+    }
 
-        while (!stk.empty() || p)
+    // The number of levels, by a level-order traversal
+    int depth() const
+    {
+        int levels = 0;
+        std::vector<tree_node *> level, next;
+        if (root)
+            level.push_back(root);
+        while (!level.empty())
         {
-            if (p)
-                stk.push(p), p = p->left;
-            else
+            ++levels;
+            next.clear();
+            for (auto p : level)
             {
-                p = stk.top(), stk.pop();
-                seq.emplace_back(p->val);
-                p = p->right;
+                if (p->left)
+                    next.push_back(p->left);
+                if (p->right)
+                    next.push_back(p->right);
             }
+            level.swap(next);
         }
+        return levels;
+    }
+
+    iterator begin() const
+    {
+        return {leftmost(root), this};
+    }
+
+    iterator end() const
+    {
+        return {nullptr, this};
+    }
+
+    // The number of keys less than 'val', O(log n) in an AVL tree
+    size_t rank(int val) const
+    {
+        size_t r = 0;
+        for (tree_node *p = root; p;)
+        {
+            if (p->val < val)
+                r += size(p->left) + 1, p = p->right;
+            else
+                p = p->left;
+        }
+        return r;
+    }
+
+    // The k-th smallest key, from 0, end() if k >= size()
+    iterator select(size_t k) const
+    {
+        tree_node *p = root;
+        while (p)
+        {
+            size_t l = size(p->left);
+            if (k < l)
+                p = p->left;
+            else if (k == l)
+                break;
+            else
+                k -= l + 1, p = p->right;
+        }
+        return {p, this};
+    }
+
+    // The first key not less than 'val'
+    iterator lower_bound(int val) const
+    {
+        tree_node *p = root, *res = nullptr;
+        while (p)
+        {
+            if (p->val < val)
+                p = p->right;
+            else
+                res = p, p = p->left;
+        }
+        return {res, this};
+    }
+
+    // The first key greater than 'val'
+    iterator upper_bound(int val) const
+    {
+        tree_node *p = root, *res = nullptr;
+        while (p)
+        {
+            if (p->val <= val)
+                p = p->right;
+            else
+                res = p, p = p->left;
+        }
+        return {res, this};
+    }
+
+    // The keys in [lo, hi], in O(log n) to find the first one, then O(1) amortized per key
+    range_t range(int lo, int hi) const
+    {
+        if (lo > hi)
+            return {end(), end()};
+        return {lower_bound(lo), upper_bound(hi)};
+    }
+
+    // Get sequence by in-order traversal
+    std::vector<int> flattern() const
+    {
+        std::vector<int> seq;
+        seq.reserve(nr_nodes);
+        for (int v : *this)
+            seq.emplace_back(v);
         return seq;
     }
 };
-} // namespace impl
\ No newline at end of file
+} // namespace impl
@@ -1,27 +1,78 @@
 #include "bst.hpp"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <assert.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-int main()
+static bool is_valid(const std::vector<int> &seq)
 {
-    auto is_valid = [](const std::vector<int> &seq) {
-        int n = seq.size();
-        for (int i = 0; i + 1 < n; ++i)
-        {
-            if (!(seq[i] < seq[i + 1]))
-                return false;
-        }
-        return true;
-    };
+    int n = seq.size();
+    for (int i = 0; i + 1 < n; ++i)
+    {
+        if (!(seq[i] < seq[i + 1]))
+            return false;
+    }
+    return true;
+}
+
+// Check the AVL property and the stored heights, return the height of 'p'
+static int check_avl(impl::tree_node *p)
+{
+    if (p == nullptr)
+        return 0;
+    int l = check_avl(p->left), r = check_avl(p->right);
+    assert(std::abs(l - r) <= 1);
+    assert(p->height == std::max(l, r) + 1);
+    return p->height;
+}
+
+// Every child points back to its parent
+static void check_parents(impl::tree_node *p, impl::tree_node *parent)
+{
+    for (; p; parent = p, p = p->right)
+    {
+        assert(p->parent == parent);
+        check_parents(p->left, p);
+    }
+}
+
+// Every subtree size is right, return the size of 'p'
+static unsigned check_sizes(impl::tree_node *p)
+{
+    if (p == nullptr)
+        return 0;
+    unsigned size = check_sizes(p->left) + check_sizes(p->right) + 1;
+    assert(p->size == size);
+    return size;
+}
 
+void test_bstree(impl::balance mode)
+{
     constexpr int N = 1024;
-    impl::bstree bst;
+    impl::bstree bst(mode);
+    auto check = [&]() {
+        assert(is_valid(bst.flattern()));
+        check_parents(bst.root, nullptr);
+        check_sizes(bst.root);
+        if (mode == impl::balance::avl)
+            check_avl(bst.root);
+    };
 
     // test 'insert'
     for (int i = 0; i < N; ++i)
     {
-        bst.insert(random() % 114514);
-        assert(is_valid(bst.flattern()));
+        int val = random() % 114514;
+        auto node = bst.insert(val);
+        assert(node == nullptr || node->val == val);
+        assert(bst.insert(val) == nullptr);
+        check();
     }
 
     auto seq = bst.flattern();
@@ -38,8 +89,380 @@ int main()
     for (int val : seq)
     {
         bst.remove(val);
-        assert(is_valid(bst.flattern()));
+        assert(bst.search(val) == nullptr);
+        check();
     }
-    
+
+    assert(bst.root == nullptr);
+}
+
+// Sorted input is the worst case of a plain tree, an AVL tree stays logarithmic
+void test_avl_sorted()
+{
+    constexpr int N = 1 << 16;
+    impl::bstree bst(impl::balance::avl);
+    for (int i = 0; i < N; ++i)
+        bst.insert(i);
+    check_avl(bst.root);
+    assert(bst.depth() <= 1.44 * std::log2(N + 2));
+
+    for (int i = 0; i < N; i += 2)
+        bst.remove(i);
+    check_avl(bst.root);
+    for (int i = 0; i < N; ++i)
+        assert((bst.search(i) != nullptr) == (i % 2 == 1));
+    for (int i = N - 1; i >= 0; --i)
+        bst.remove(i);
     assert(bst.root == nullptr);
-}
\ No newline at end of file
+}
+
+// Nodes come from the pool of the tree, freed ones are reused
+void test_pool()
+{
+    impl::bstree bst;
+    auto a = bst.insert(1), b = bst.insert(2), c = bst.insert(3);
+    assert(b == a + 1 && c == b + 1);
+    bst.remove(2);
+    assert(bst.insert(4) == b);
+
+    impl::bstree moved(std::move(bst));
+    assert(bst.root == nullptr && moved.search(4) == b);
+
+    moved.clear();
+    assert(moved.root == nullptr && moved.search(1) == nullptr);
+    for (int i = 0; i < 1000; ++i)
+        moved.insert(i);
+    assert(moved.flattern().size() == 1000);
+
+    // the nodes of the target go with its pool
+    impl::bstree avl(impl::balance::avl);
+    for (int i = 0; i < 100; ++i)
+        avl.insert(-i);
+    avl = std::move(moved);
+    assert(moved.root == nullptr && moved.size() == 0 && avl.size() == 1000);
+    assert(avl.search(999) && !avl.search(-1) && avl.flattern().size() == 1000);
+    moved.insert(5);
+    assert(moved.size() == 1 && moved.search(5));
+}
+
+void test_iterators(impl::balance mode)
+{
+    impl::bstree bst(mode);
+    std::set<int> ref;
+    assert(bst.begin() == bst.end() && bst.lower_bound(0) == bst.end());
+    for (int i = 0; i < 3000; ++i)
+    {
+        int k = random() % 10000;
+        bst.insert(k), ref.insert(k);
+    }
+    for (int i = 0; i < 1000; ++i)
+    {
+        int k = random() % 10000;
+        bst.remove(k), ref.erase(k);
+    }
+    check_parents(bst.root, nullptr);
+
+    // both directions, and the standard algorithms
+    assert(std::equal(bst.begin(), bst.end(), ref.begin(), ref.end()));
+    assert(std::equal(std::make_reverse_iterator(bst.end()), std::make_reverse_iterator(bst.begin()), ref.rbegin(),
+                      ref.rend()));
+    assert((size_t)std::distance(bst.begin(), bst.end()) == bst.size());
+
+    for (int x = -1; x <= 10001; x += 7)
+    {
+        auto lb = bst.lower_bound(x), ub = bst.upper_bound(x);
+        auto rlb = ref.lower_bound(x), rub = ref.upper_bound(x);
+        assert(lb == bst.end() ? rlb == ref.end() : *lb == *rlb);
+        assert(ub == bst.end() ? rub == ref.end() : *ub == *rub);
+
+        int hi = x + random() % 200;
+        auto r = bst.range(x, hi);
+        assert(std::equal(r.begin(), r.end(), ref.lower_bound(x), ref.upper_bound(hi)));
+    }
+    auto empty = bst.range(10, 5);
+    assert(empty.begin() == empty.end());
+
+    // the first few keys, without materializing the rest
+    int nr = 0;
+    for (int v : bst.range(INT_MIN, INT_MAX))
+    {
+        assert(v == *std::next(ref.begin(), nr));
+        if (++nr == 5)
+            break;
+    }
+
+    // inserts and their rotations keep iterators valid
+    auto it = bst.lower_bound(5000);
+    int v = *it;
+    for (int i = 0; i < 2000; ++i)
+        bst.insert(10000 + i);
+    assert(*it == v && bst.lower_bound(5000) == it);
+}
+
+// rank and select against a sorted vector, while the set changes
+void test_rank_select(impl::balance mode)
+{
+    impl::bstree bst(mode);
+    std::set<int> ref;
+    for (int round = 0; round < 20; ++round)
+    {
+        for (int i = 0; i < 300; ++i)
+        {
+            int k = random() % 5000;
+            if (random() % 3)
+                bst.insert(k), ref.insert(k);
+            else
+                bst.remove(k), ref.erase(k);
+        }
+        check_sizes(bst.root);
+        std::vector<int> seq(ref.begin(), ref.end());
+        for (size_t i = 0; i < seq.size(); ++i)
+            assert(*bst.select(i) == seq[i] && bst.rank(seq[i]) == i);
+        assert(bst.select(seq.size()) == bst.end());
+        for (int x = -1; x <= 5001; x += 13)
+            assert(bst.rank(x) == (size_t)(std::lower_bound(seq.begin(), seq.end(), x) - seq.begin()));
+    }
+
+    impl::bstree built(mode);
+    built.build_from_sorted(std::vector<int>{1, 3, 5, 7, 9});
+    check_sizes(built.root);
+    assert(*built.select(2) == 5 && built.rank(6) == 3 && built.rank(100) == 5);
+}
+
+// A rolling median over a changing set: select against indexing flattern()
+void bench_rank(int n)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    impl::bstree bst(impl::balance::avl);
+    for (int i = 0; i < n; ++i)
+        bst.insert(random());
+
+    // flattern() is O(n) per query, it gets few of them
+    constexpr int nr_select = 100000, nr_flattern = 10;
+    long sum = 0;
+    auto t0 = clock::now();
+    for (int i = 0; i < nr_select; ++i)
+    {
+        bst.insert(random());
+        sum += *bst.select(bst.size() / 2);
+    }
+    auto t1 = clock::now();
+    for (int i = 0; i < nr_flattern; ++i)
+    {
+        bst.insert(random());
+        auto seq = bst.flattern();
+        sum += seq[seq.size() / 2];
+    }
+    auto t2 = clock::now();
+    std::cout << n << " keys, median after each insert: select " << ms(t1 - t0) * 1e3 / nr_select
+              << " us, flattern " << ms(t2 - t1) * 1e3 / nr_flattern << " us (" << sum % 10 << ")" << std::endl;
+}
+
+void test_build_and_merge()
+{
+    for (int n = 0; n <= 200; ++n)
+    {
+        std::vector<int> seq(n);
+        for (int i = 0; i < n; ++i)
+            seq[i] = i * 2;
+        impl::bstree bst(impl::balance::avl);
+        bst.insert(-1);
+        bst.build_from_sorted(seq);
+        assert(bst.flattern() == seq && bst.size() == (size_t)n);
+        check_avl(bst.root);
+        check_parents(bst.root, nullptr);
+        // as balanced as a tree can be
+        int levels = 0;
+        while ((1 << levels) <= n)
+            levels++;
+        assert(bst.depth() == levels);
+
+        // the tree stays usable
+        bst.insert(1), bst.remove(0);
+        check_avl(bst.root);
+        assert(bst.search(1) && !bst.search(0));
+    }
+
+    impl::bstree a, b;
+    std::vector<int> odd, mixed;
+    for (int i = 0; i < 1000; ++i)
+        odd.push_back(i * 2 + 1), mixed.push_back(i * 3);
+    a.build_from_sorted(odd.begin(), odd.end());
+    b.build_from_sorted(mixed);
+    a.merge(b);
+    std::vector<int> expect;
+    std::set_union(odd.begin(), odd.end(), mixed.begin(), mixed.end(), std::back_inserter(expect));
+    assert(a.flattern() == expect && a.size() == expect.size() && b.flattern() == mixed);
+    a.merge(impl::bstree());
+    assert(a.flattern() == expect);
+}
+
+// Loading a sorted dump: n inserts against one build_from_sorted
+void bench_build(int n)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; ++i)
+        keys[i] = i;
+
+    impl::bstree bst(impl::balance::avl);
+    auto t0 = clock::now();
+    for (int k : keys)
+        bst.insert(k);
+    auto t1 = clock::now();
+    bst.build_from_sorted(keys);
+    auto t2 = clock::now();
+    impl::bstree other;
+    other.build_from_sorted(keys.begin() + n / 2, keys.end());
+    auto t3 = clock::now();
+    bst.merge(other);
+    auto t4 = clock::now();
+    assert(bst.size() == (size_t)n);
+    std::cout << n << " sorted keys: avl inserts " << ms(t1 - t0) << " ms, build_from_sorted " << ms(t2 - t1)
+              << " ms, merge with " << n / 2 << " keys " << ms(t4 - t3) << " ms" << std::endl;
+}
+
+void bench(const char *input, const std::vector<int> &keys)
+{
+    using clock = std::chrono::steady_clock;
+    for (auto mode : {impl::balance::none, impl::balance::avl})
+    {
+        impl::bstree bst(mode);
+        auto t0 = clock::now();
+        for (int k : keys)
+            bst.insert(k);
+        auto t1 = clock::now();
+        long found = 0;
+        for (int k : keys)
+            found += bst.search(k) != nullptr;
+        auto t2 = clock::now();
+        int depth = bst.depth();
+        for (int k : keys)
+            bst.remove(k);
+        auto t3 = clock::now();
+        assert(found == (long)keys.size());
+
+        auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+        std::cout << input << (mode == impl::balance::avl ? ", avl:  " : ", none: ") << "depth " << depth
+                  << ", insert " << ms(t1 - t0) << " ms, search " << ms(t2 - t1) << " ms, remove " << ms(t3 - t2)
+                  << " ms" << std::endl;
+    }
+}
+
+// Per-node new: the same tree_node, one 'new' per node and freed one by one, so only the allocation differs
+struct heap_tree
+{
+    impl::tree_node *root = nullptr;
+
+    void insert(int val)
+    {
+        impl::tree_node **link = &root;
+        while (*link)
+        {
+            if ((*link)->val == val)
+                return;
+            link = ((*link)->val < val) ? &(*link)->right : &(*link)->left;
+        }
+        *link = new impl::tree_node(val);
+    }
+
+    ~heap_tree()
+    {
+        std::vector<impl::tree_node *> stk;
+        if (root)
+            stk.push_back(root);
+        while (!stk.empty())
+        {
+            auto p = stk.back();
+            stk.pop_back();
+            if (p->left)
+                stk.push_back(p->left);
+            if (p->right)
+                stk.push_back(p->right);
+            delete p;
+        }
+    }
+};
+
+static long sum_in_order(impl::tree_node *p)
+{
+    long sum = 0;
+    std::vector<impl::tree_node *> stk;
+    while (!stk.empty() || p)
+    {
+        if (p)
+            stk.push_back(p), p = p->left;
+        else
+        {
+            p = stk.back(), stk.pop_back();
+            sum += p->val;
+            p = p->right;
+        }
+    }
+    return sum;
+}
+
+// Insert, traverse and free 'keys' in a child process, so its peak RSS is its own
+template <class Tree> void bench_alloc(const char *name, const std::vector<int> &keys)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        double t_insert, t_walk, t_free;
+        long sum = 0;
+        auto t0 = clock::now();
+        auto tree = std::make_unique<Tree>();
+        for (int k : keys)
+            tree->insert(k);
+        auto t1 = clock::now();
+        for (int i = 0; i < 10; ++i)
+            sum += sum_in_order(tree->root);
+        auto t2 = clock::now();
+        tree.reset();
+        auto t3 = clock::now();
+        t_insert = ms(t1 - t0), t_walk = ms(t2 - t1) / 10, t_free = ms(t3 - t2);
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        std::cout << name << ": insert " << t_insert << " ms, in-order walk " << t_walk << " ms, free " << t_free
+                  << " ms, peak RSS " << ru.ru_maxrss / 1024 << " MB (sum " << sum << ")" << std::endl;
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+int main()
+{
+    test_bstree(impl::balance::none);
+    test_bstree(impl::balance::avl);
+    test_avl_sorted();
+    test_pool();
+    test_build_and_merge();
+    test_iterators(impl::balance::none);
+    test_iterators(impl::balance::avl);
+    test_rank_select(impl::balance::none);
+    test_rank_select(impl::balance::avl);
+
+    // a plain tree is quadratic on sorted input, keep it small
+    constexpr int N = 20000;
+    std::vector<int> sorted(N), shuffled(N);
+    for (int i = 0; i < N; ++i)
+        sorted[i] = i, shuffled[i] = i;
+    for (int i = N - 1; i > 0; --i)
+        std::swap(shuffled[i], shuffled[random() % (i + 1)]);
+    bench("sorted", sorted);
+    bench("random", shuffled);
+
+    std::vector<int> keys(1 << 20);
+    for (auto &k : keys)
+        k = random();
+    bench_alloc<heap_tree>("new per node", keys);
+    bench_alloc<impl::bstree>("node pool   ", keys);
+
+    bench_build(1 << 22);
+    bench_rank(1 << 20);
+}
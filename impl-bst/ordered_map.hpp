@@ -0,0 +1,568 @@
+/* An ordered key/value map, an AVL tree balanced by the same avl_core as bstree.
+ * - Nodes keep a parent pointer, so iterators are bidirectional and need no stack.
+ * - A node holds a std::pair<const K, V> and never moves: erasing a node relinks its successor into its place
+ *   rather than copying the successor's value, so iterators to other elements stay valid.
+ * - try_emplace (and emplace with a key) looks the key up first, the node is constructed in place only when
+ *   the key is absent.
+ * - Heterogeneous lookup when 'Compare' is transparent, e.g. std::less<>.
+ */
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "avl_core.hpp"
+
+namespace impl
+{
+template <class K, class V, class Compare = std::less<K>> class ordered_map
+{
+  public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using size_type = size_t;
+    using key_compare = Compare;
+
+  private:
+    struct node
+    {
+        node *left, *right, *parent;
+        int height;
+        value_type kv;
+
+        template <class... Args>
+        node(node *parent, Args &&...args)
+            : left(nullptr), right(nullptr), parent(parent), height(1), kv(std::forward<Args>(args)...)
+        {
+        }
+    };
+
+    template <bool Const> class iter
+    {
+        friend class ordered_map;
+        using map_ptr = std::conditional_t<Const, const ordered_map *, ordered_map *>;
+
+        node *p;   // nullptr for end()
+        map_ptr m; // to step back from end()
+
+        iter(node *p, map_ptr m) : p(p), m(m)
+        {
+        }
+
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename ordered_map::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+        using reference = std::conditional_t<Const, const value_type &, value_type &>;
+
+        iter() : p(nullptr), m(nullptr)
+        {
+        }
+
+        // iterator -> const_iterator
+        template <bool C, class = std::enable_if_t<Const && !C>>
+        iter(const iter<C> &it) : p(it.p), m(it.m)
+        {
+        }
+
+        reference operator*() const
+        {
+            return p->kv;
+        }
+
+        pointer operator->() const
+        {
+            return &p->kv;
+        }
+
+        iter &operator++()
+        {
+            p = next(p);
+            return *this;
+        }
+
+        iter operator++(int)
+        {
+            iter it = *this;
+            ++*this;
+            return it;
+        }
+
+        iter &operator--()
+        {
+            p = p ? prev(p) : rightmost(m->root);
+            return *this;
+        }
+
+        iter operator--(int)
+        {
+            iter it = *this;
+            --*this;
+            return it;
+        }
+
+        friend bool operator==(const iter &a, const iter &b)
+        {
+            return a.p == b.p;
+        }
+
+        friend bool operator!=(const iter &a, const iter &b)
+        {
+            return a.p != b.p;
+        }
+    };
+
+  public:
+    using iterator = iter<false>;
+    using const_iterator = iter<true>;
+
+    explicit ordered_map(const Compare &comp = Compare()) : root(nullptr), nr_nodes(0), comp(comp)
+    {
+    }
+
+    // The partial copy is freed if copying an element throws
+    ordered_map(const ordered_map &m) : root(nullptr), nr_nodes(0), comp(m.comp)
+    {
+        try
+        {
+            clone(m.root, nullptr, &root);
+        }
+        catch (...)
+        {
+            clear();
+            throw;
+        }
+        nr_nodes = m.nr_nodes;
+    }
+
+    ordered_map(ordered_map &&m) noexcept : root(m.root), nr_nodes(m.nr_nodes), comp(m.comp)
+    {
+        m.root = nullptr, m.nr_nodes = 0;
+    }
+
+    ordered_map &operator=(ordered_map m) noexcept
+    {
+        swap(m);
+        return *this;
+    }
+
+    ~ordered_map()
+    {
+        clear();
+    }
+
+    void swap(ordered_map &m) noexcept
+    {
+        std::swap(root, m.root), std::swap(nr_nodes, m.nr_nodes), std::swap(comp, m.comp);
+    }
+
+    size_t size() const
+    {
+        return nr_nodes;
+    }
+
+    bool empty() const
+    {
+        return nr_nodes == 0;
+    }
+
+    // Iterative, freeing each node once its left subtree is gone
+    void clear()
+    {
+        node *p = root;
+        while (p)
+        {
+            if (p->left)
+            {
+                // rotate the left child up, so the left spine shrinks
+                node *l = p->left;
+                p->left = l->right, l->right = p;
+                p = l;
+            }
+            else
+            {
+                node *r = p->right;
+                delete p;
+                p = r;
+            }
+        }
+        root = nullptr, nr_nodes = 0;
+    }
+
+    iterator begin()
+    {
+        return {leftmost(root), this};
+    }
+
+    iterator end()
+    {
+        return {nullptr, this};
+    }
+
+    const_iterator begin() const
+    {
+        return {leftmost(root), this};
+    }
+
+    const_iterator end() const
+    {
+        return {nullptr, this};
+    }
+
+    /* Insertion */
+
+    // Construct 'V(args...)' under 'key' unless 'key' exists, in which case nothing is constructed or moved
+    template <class... Args> std::pair<iterator, bool> try_emplace(const K &key, Args &&...args)
+    {
+        return emplace_key(key, std::forward<Args>(args)...);
+    }
+
+    template <class... Args> std::pair<iterator, bool> try_emplace(K &&key, Args &&...args)
+    {
+        return emplace_key(std::move(key), std::forward<Args>(args)...);
+    }
+
+    // With a key and a value, the key is looked up before the node is built. Otherwise the pair has to be
+    // constructed to know its key, and the node is freed again if the key exists.
+    template <class... Args> std::pair<iterator, bool> emplace(Args &&...args)
+    {
+        if constexpr (sizeof...(Args) == 2 && is_key<first_t<Args...>>)
+            return emplace_key(std::forward<Args>(args)...);
+        else
+        {
+            node *n = new node(nullptr, std::forward<Args>(args)...);
+            auto [parent, link] = find_slot(n->kv.first);
+            if (*link)
+            {
+                delete n;
+                return {iterator(*link, this), false};
+            }
+            return {iterator(attach(n, parent, link), this), true};
+        }
+    }
+
+    std::pair<iterator, bool> insert(const value_type &kv)
+    {
+        return emplace_key(kv.first, kv.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type &&kv)
+    {
+        // the key is const, so it is copied
+        return emplace_key(kv.first, std::move(kv.second));
+    }
+
+    template <class M> std::pair<iterator, bool> insert_or_assign(const K &key, M &&val)
+    {
+        auto res = emplace_key(key, std::forward<M>(val));
+        if (!res.second)
+            res.first->second = std::forward<M>(val);
+        return res;
+    }
+
+    V &operator[](const K &key)
+    {
+        return emplace_key(key).first->second;
+    }
+
+    V &operator[](K &&key)
+    {
+        return emplace_key(std::move(key)).first->second;
+    }
+
+    /* Lookup, the template overloads are for a transparent 'Compare' */
+
+    V &at(const K &key)
+    {
+        node *p = find_node(key);
+        if (p == nullptr)
+            throw std::out_of_range("ordered_map::at");
+        return p->kv.second;
+    }
+
+    const V &at(const K &key) const
+    {
+        return const_cast<ordered_map *>(this)->at(key);
+    }
+
+    iterator find(const K &key)
+    {
+        return {find_node(key), this};
+    }
+
+    const_iterator find(const K &key) const
+    {
+        return {find_node(key), this};
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent> iterator find(const Key &key)
+    {
+        return {find_node(key), this};
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator find(const Key &key) const
+    {
+        return {find_node(key), this};
+    }
+
+    bool contains(const K &key) const
+    {
+        return find_node(key) != nullptr;
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent> bool contains(const Key &key) const
+    {
+        return find_node(key) != nullptr;
+    }
+
+    size_t count(const K &key) const
+    {
+        return find_node(key) != nullptr;
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent> size_t count(const Key &key) const
+    {
+        return find_node(key) != nullptr;
+    }
+
+    // The first element whose key is not less than 'key'
+    iterator lower_bound(const K &key)
+    {
+        return {bound(key, false), this};
+    }
+
+    const_iterator lower_bound(const K &key) const
+    {
+        return {bound(key, false), this};
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    iterator lower_bound(const Key &key)
+    {
+        return {bound(key, false), this};
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator lower_bound(const Key &key) const
+    {
+        return {bound(key, false), this};
+    }
+
+    // The first element whose key is greater than 'key'
+    iterator upper_bound(const K &key)
+    {
+        return {bound(key, true), this};
+    }
+
+    const_iterator upper_bound(const K &key) const
+    {
+        return {bound(key, true), this};
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    iterator upper_bound(const Key &key)
+    {
+        return {bound(key, true), this};
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator upper_bound(const Key &key) const
+    {
+        return {bound(key, true), this};
+    }
+
+    /* Removal */
+
+    // Return the iterator following 'pos'
+    iterator erase(const_iterator pos)
+    {
+        node *n = next(pos.p);
+        erase_node(pos.p);
+        return {n, this};
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(const_iterator(pos));
+    }
+
+    size_t erase(const K &key)
+    {
+        node *p = find_node(key);
+        if (p == nullptr)
+            return 0;
+        erase_node(p);
+        return 1;
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent> size_t erase(const Key &key)
+    {
+        node *p = find_node(key);
+        if (p == nullptr)
+            return 0;
+        erase_node(p);
+        return 1;
+    }
+
+    // The number of levels, 0 for an empty map
+    int depth() const
+    {
+        return avl::height(root);
+    }
+
+  private:
+    using avl = avl_core<node>;
+
+    template <class... Args> using first_t = std::tuple_element_t<0, std::tuple<Args...>>;
+    template <class T> static constexpr bool is_key = std::is_same_v<std::decay_t<T>, K>;
+
+    static node *leftmost(node *p)
+    {
+        while (p && p->left)
+            p = p->left;
+        return p;
+    }
+
+    static node *rightmost(node *p)
+    {
+        while (p && p->right)
+            p = p->right;
+        return p;
+    }
+
+    // The in-order successor, nullptr after the last node
+    static node *next(node *p)
+    {
+        if (p->right)
+            return leftmost(p->right);
+        while (p->parent && p == p->parent->right)
+            p = p->parent;
+        return p->parent;
+    }
+
+    static node *prev(node *p)
+    {
+        if (p->left)
+            return rightmost(p->left);
+        while (p->parent && p == p->parent->left)
+            p = p->parent;
+        return p->parent;
+    }
+
+    // Copy the subtree 'p' to '*link', linking each node before its children are copied, so a throw leaves a
+    // tree that clear() can free
+    static void clone(const node *p, node *parent, node **link)
+    {
+        if (p == nullptr)
+            return;
+        // the recursion is bounded by the height of an AVL tree
+        node *n = *link = new node(parent, p->kv);
+        n->height = p->height;
+        clone(p->left, n, &n->left);
+        clone(p->right, n, &n->right);
+    }
+
+    template <class Key> node *find_node(const Key &key) const
+    {
+        node *p = root;
+        while (p)
+        {
+            if (comp(key, p->kv.first))
+                p = p->left;
+            else if (comp(p->kv.first, key))
+                p = p->right;
+            else
+                break;
+        }
+        return p;
+    }
+
+    // 'strict': the first key greater than 'key', otherwise the first one not less than it
+    template <class Key> node *bound(const Key &key, bool strict) const
+    {
+        node *p = root, *res = nullptr;
+        while (p)
+        {
+            if (strict ? comp(key, p->kv.first) : !comp(p->kv.first, key))
+                res = p, p = p->left;
+            else
+                p = p->right;
+        }
+        return res;
+    }
+
+    // Where 'key' is, or where it would be linked: '*link' is the node holding it, or nullptr
+    template <class Key> std::pair<node *, node **> find_slot(const Key &key)
+    {
+        node *parent = nullptr, **link = &root;
+        while (*link)
+        {
+            if (comp(key, (*link)->kv.first))
+                parent = *link, link = &parent->left;
+            else if (comp((*link)->kv.first, key))
+                parent = *link, link = &parent->right;
+            else
+                break;
+        }
+        return {parent, link};
+    }
+
+    template <class Key, class... Args> std::pair<iterator, bool> emplace_key(Key &&key, Args &&...args)
+    {
+        auto [parent, link] = find_slot(key);
+        if (*link)
+            return {iterator(*link, this), false};
+        node *n = new node(parent, std::piecewise_construct, std::forward_as_tuple(std::forward<Key>(key)),
+                           std::forward_as_tuple(std::forward<Args>(args)...));
+        return {iterator(attach(n, parent, link), this), true};
+    }
+
+    node *attach(node *n, node *parent, node **link)
+    {
+        n->parent = parent;
+        *link = n;
+        nr_nodes++;
+        avl::rebalance(root, parent);
+        return n;
+    }
+
+    void erase_node(node *z)
+    {
+        node *start;
+        if (z->left && z->right)
+        {
+            // relink the successor 'y', which has no left child, into the place of 'z'
+            node *y = leftmost(z->right);
+            if (y->parent == z)
+                start = y;
+            else
+            {
+                start = y->parent;
+                avl::transplant(root, y, y->right);
+                y->right = z->right, y->right->parent = y;
+            }
+            avl::transplant(root, z, y);
+            y->left = z->left, y->left->parent = y;
+        }
+        else
+        {
+            start = z->parent;
+            avl::transplant(root, z, z->left ? z->left : z->right);
+        }
+        delete z;
+        nr_nodes--;
+        avl::rebalance(root, start);
+    }
+
+    node *root;
+    size_t nr_nodes;
+    Compare comp;
+};
+} // namespace impl
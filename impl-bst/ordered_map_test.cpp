@@ -0,0 +1,232 @@
+#include "ordered_map.hpp"
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <assert.h>
+
+// Counts its constructions, to check that a duplicate key constructs nothing
+struct payload
+{
+    static inline int nr_constructed = 0;
+    int v;
+    payload(int v = 0) : v(v)
+    {
+        nr_constructed++;
+    }
+    payload(const payload &p) : v(p.v)
+    {
+        nr_constructed++;
+    }
+    payload &operator=(const payload &) = default;
+};
+
+template <class Map> static bool is_avl_sized(const Map &m)
+{
+    // an AVL tree of n nodes has less than 1.44 * log2(n + 2) levels
+    int levels = 0;
+    for (size_t n = m.size() + 2; n > 1; n >>= 1)
+        levels++;
+    return m.depth() <= 1.45 * levels;
+}
+
+// Random operations, checked against std::map
+void test_against_std_map()
+{
+    constexpr int N = 20000, range = 4096;
+    impl::ordered_map<int, int> m;
+    std::map<int, int> ref;
+
+    for (int i = 0; i < N; ++i)
+    {
+        int k = random() % range, op = random() % 4;
+        if (op == 0)
+        {
+            auto [it, ok] = m.try_emplace(k, i);
+            auto [rit, rok] = ref.try_emplace(k, i);
+            assert(ok == rok && it->first == k && it->second == rit->second);
+        }
+        else if (op == 1)
+        {
+            m[k] = i, ref[k] = i;
+        }
+        else if (op == 2)
+            assert(m.erase(k) == ref.erase(k));
+        else
+        {
+            auto it = m.lower_bound(k);
+            auto rit = ref.lower_bound(k);
+            assert((it == m.end()) == (rit == ref.end()));
+            if (rit != ref.end())
+                assert(it->first == rit->first && it->second == rit->second);
+            auto ut = m.upper_bound(k);
+            auto rut = ref.upper_bound(k);
+            assert((ut == m.end()) == (rut == ref.end()));
+            if (rut != ref.end())
+                assert(ut->first == rut->first);
+        }
+        assert(m.size() == ref.size());
+    }
+    assert(is_avl_sized(m));
+
+    // forward and backward traversal
+    std::vector<std::pair<int, int>> fwd(m.begin(), m.end()), expect(ref.begin(), ref.end());
+    assert(fwd == expect);
+    auto it = m.end();
+    for (auto rit = ref.rbegin(); rit != ref.rend(); ++rit)
+        assert((--it)->first == rit->first);
+    assert(it == m.begin());
+
+    // erase while iterating, the other iterators stay valid
+    auto keep = std::prev(m.end());
+    while (keep->first % 2 == 0)
+        --keep;
+    for (auto i = m.begin(); i != m.end();)
+        i = (i->first % 2 == 0) ? m.erase(i) : std::next(i);
+    for (auto &[k, v] : m)
+        assert(k % 2 == 1 && ref.at(k) == v);
+    assert(m.find(keep->first) == keep && std::next(keep) == m.end());
+
+    // copy, move, clear
+    auto copy = m;
+    assert(copy.size() == m.size() && std::equal(copy.begin(), copy.end(), m.begin()));
+    auto moved = std::move(copy);
+    assert(copy.empty() && moved.size() == m.size());
+    m.clear();
+    assert(m.empty() && m.begin() == m.end());
+    assert(moved.begin() != moved.end());
+}
+
+// try_emplace and emplace with a key build nothing when the key exists
+void test_emplace()
+{
+    impl::ordered_map<int, payload> m;
+    payload::nr_constructed = 0;
+    assert(m.try_emplace(1, 10).second);
+    assert(m.emplace(2, 20).second);
+    assert(payload::nr_constructed == 2);
+
+    assert(!m.try_emplace(1, 11).second);
+    assert(!m.emplace(2, 21).second);
+    assert(payload::nr_constructed == 2);
+    assert(m.at(1).v == 10 && m.at(2).v == 20);
+
+    // a pair has to be built to know its key
+    assert(!m.emplace(std::pair<const int, payload>(1, 12)).second);
+    assert(m.at(1).v == 10);
+
+    m.insert_or_assign(1, payload(13));
+    assert(m.at(1).v == 13);
+
+    bool thrown = false;
+    try
+    {
+        m.at(3);
+    }
+    catch (const std::out_of_range &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // a move-only value
+    impl::ordered_map<std::string, std::unique_ptr<int>> u;
+    u.try_emplace("a", new int(1));
+    auto p = std::make_unique<int>(2);
+    assert(!u.try_emplace("a", std::move(p)).second);
+    assert(p != nullptr && *u.at("a") == 1);
+}
+
+// Lookup by std::string_view / const char * without building a std::string
+void test_heterogeneous()
+{
+    impl::ordered_map<std::string, int, std::less<>> m;
+    for (auto s : {"apple", "banana", "cherry", "date"})
+        m.emplace(s, (int)std::string_view(s).size());
+
+    std::string_view key = "banana";
+    assert(m.find(key) != m.end() && m.find(key)->second == 6);
+    assert(m.contains("cherry") && !m.contains(std::string_view("fig")));
+    assert(m.count("date") == 1);
+    assert(m.lower_bound(std::string_view("b"))->first == "banana");
+    assert(m.upper_bound("banana")->first == "cherry");
+    assert(m.erase(std::string_view("apple")) == 1);
+    assert(m.begin()->first == "banana");
+
+    const auto &cm = m;
+    impl::ordered_map<std::string, int, std::less<>>::const_iterator it = cm.find("date");
+    assert(it->second == 4 && ++it == cm.end());
+}
+
+// Sorted input keeps the tree balanced
+void test_sorted()
+{
+    constexpr int N = 1 << 16;
+    impl::ordered_map<int, int> m;
+    for (int i = 0; i < N; ++i)
+        m.try_emplace(i, i);
+    assert(is_avl_sized(m));
+    for (int i = 0; i < N; i += 3)
+        m.erase(i);
+    assert(is_avl_sized(m));
+    int expect = 1;
+    for (auto &[k, v] : m)
+    {
+        assert(k == expect && v == k);
+        expect += (expect % 3 == 1) ? 1 : 2;
+    }
+}
+
+// Throws on the copy that brings the number of live copies to 'limit'
+struct fragile
+{
+    static inline int nr_alive = 0, limit = 0;
+    fragile()
+    {
+        nr_alive++;
+    }
+    fragile(const fragile &)
+    {
+        if (nr_alive + 1 == limit)
+            throw std::runtime_error("fragile");
+        nr_alive++;
+    }
+    ~fragile()
+    {
+        nr_alive--;
+    }
+};
+
+// A copy that throws halfway frees what it has copied
+void test_copy_throws()
+{
+    impl::ordered_map<int, fragile> m;
+    for (int i = 0; i < 1000; ++i)
+        m.try_emplace(i);
+    fragile::limit = 1500;
+    try
+    {
+        impl::ordered_map<int, fragile> copy(m);
+        assert(false);
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+    assert(fragile::nr_alive == 1000 && m.size() == 1000);
+    fragile::limit = 0;
+    impl::ordered_map<int, fragile> copy(m);
+    assert(fragile::nr_alive == 2000 && copy.size() == 1000 && is_avl_sized(copy));
+}
+
+int main()
+{
+    test_against_std_map();
+    test_emplace();
+    test_heterogeneous();
+    test_sorted();
+    test_copy_throws();
+    std::cout << "ordered_map: all tests passed" << std::endl;
+}
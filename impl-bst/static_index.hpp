@@ -0,0 +1,141 @@
+/* A read-only snapshot of a sorted set of ints, in Eytzinger (BFS) order in one contiguous array:
+ * - a[1] is the root, the children of a[k] are a[2k] and a[2k+1], so the first levels of every search share the
+ *   same few cache lines;
+ * - the search has no data-dependent branch, k = 2k + (a[k] < x), and prefetches the 16 descendants 4 levels
+ *   below, which sit in one cache line since the array is aligned to one and a[0] is unused;
+ * - (re)building is one in-order pass over the sorted input, which fills the implicit tree in in-order too, and it
+ *   reuses the array when the new set is not larger.
+ */
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "bst.hpp"
+
+namespace impl
+{
+class static_index
+{
+  public:
+    static constexpr size_t cache_line = 64;
+
+    static_index() : n(0), cap(0)
+    {
+    }
+
+    // from a sorted sequence without duplicates, such as bstree::flattern()
+    explicit static_index(const std::vector<int> &sorted) : static_index()
+    {
+        assign(sorted.begin(), sorted.end());
+    }
+
+    explicit static_index(const bstree &tree) : static_index()
+    {
+        rebuild(tree);
+    }
+
+    template <class It> void assign(It first, It last)
+    {
+        reserve(std::distance(first, last));
+        for (size_t k = first_slot(); first != last; ++first, k = next_slot(k))
+            a[k] = *first;
+    }
+
+    // Take a new snapshot of 'tree', walking it in-order straight into the array, without flattern()
+    void rebuild(const bstree &tree)
+    {
+        reserve(tree.size());
+        size_t k = first_slot();
+        for (int v : tree)
+            a[k] = v, k = next_slot(k);
+    }
+
+    size_t size() const
+    {
+        return n;
+    }
+
+    // The smallest key not less than 'x', nullptr if there is none
+    const int *lower_bound(int x) const
+    {
+        size_t k = 1;
+        while (k <= n)
+        {
+            // a[16k, 16k + 16) may lie past the end, a prefetch does not fault
+            __builtin_prefetch(a.get() + 16 * k);
+            k = 2 * k + (a[k] < x);
+        }
+        // 'k' went right (a[k] < x) for the trailing 1 bits, undo them and the last left turn
+        k >>= __builtin_ffsll(~k);
+        return k ? &a[k] : nullptr;
+    }
+
+    bool search(int x) const
+    {
+        auto p = lower_bound(x);
+        return p && *p == x;
+    }
+
+    // The keys in order, as flattern() of the tree
+    std::vector<int> flattern() const
+    {
+        std::vector<int> seq;
+        seq.reserve(n);
+        for (size_t k = first_slot(); k != 0; k = next_slot(k))
+            seq.push_back(a[k]);
+        return seq;
+    }
+
+  private:
+    struct aligned_delete
+    {
+        void operator()(int *p) const
+        {
+            ::operator delete[](p, std::align_val_t(cache_line));
+        }
+    };
+
+    // 'size' keys, slot 0 unused. Keeps the array when it is large enough.
+    void reserve(size_t size)
+    {
+        if (size + 1 > cap)
+        {
+            a.reset(static_cast<int *>(::operator new[]((size + 1) * sizeof(int), std::align_val_t(cache_line))));
+            cap = size + 1;
+        }
+        n = size;
+    }
+
+    // The in-order first slot of the implicit tree, the leftmost one, 0 if empty
+    size_t first_slot() const
+    {
+        size_t k = n ? 1 : 0;
+        while (k && 2 * k <= n)
+            k = 2 * k;
+        return k;
+    }
+
+    // The in-order successor of slot 'k', 0 after the last one
+    size_t next_slot(size_t k) const
+    {
+        if (2 * k + 1 <= n)
+        {
+            k = 2 * k + 1;
+            while (2 * k <= n)
+                k = 2 * k;
+            return k;
+        }
+        // climb while 'k' is a right child, then once more
+        while (k & 1)
+            k >>= 1;
+        return k >> 1;
+    }
+
+    std::unique_ptr<int[], aligned_delete> a;
+    size_t n;   // the number of keys, in a[1..n]
+    size_t cap; // the number of slots of 'a'
+};
+} // namespace impl
@@ -0,0 +1,97 @@
+#include "static_index.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <assert.h>
+
+// lower_bound and search against std::lower_bound, for every size up to a few levels
+void test_small()
+{
+    impl::static_index index;
+    for (int n = 0; n <= 300; ++n)
+    {
+        std::vector<int> keys(n);
+        for (int i = 0; i < n; ++i)
+            keys[i] = i * 3 + 1;
+        index.assign(keys.begin(), keys.end());
+        assert(index.size() == (size_t)n && index.flattern() == keys);
+
+        for (int x = -1; x <= n * 3 + 2; ++x)
+        {
+            auto it = std::lower_bound(keys.begin(), keys.end(), x);
+            auto p = index.lower_bound(x);
+            assert(it == keys.end() ? p == nullptr : p && *p == *it);
+            assert(index.search(x) == (x % 3 == 1 && x < n * 3));
+        }
+    }
+}
+
+// A snapshot of a bstree, taken again after the tree changed
+void test_rebuild()
+{
+    impl::bstree bst(impl::balance::avl);
+    for (int i = 0; i < 10000; ++i)
+        bst.insert(random() % 100000);
+    impl::static_index index(bst);
+    assert(index.flattern() == bst.flattern() && index.size() == bst.size());
+    auto seq = bst.flattern();
+    for (int v : seq)
+        assert(index.search(v));
+
+    for (int i = 0; i < 5000; ++i)
+        bst.remove(seq[random() % seq.size()]);
+    assert(index.search(seq[0]));
+    index.rebuild(bst);
+    assert(index.flattern() == bst.flattern());
+    assert(impl::static_index(bst.flattern()).flattern() == bst.flattern());
+
+    bst.clear();
+    index.rebuild(bst);
+    assert(index.size() == 0 && index.lower_bound(0) == nullptr);
+}
+
+// Random lookups: the tree, a binary search over flattern(), and the snapshot
+void bench(int n)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    impl::bstree bst(impl::balance::avl);
+    for (int i = 0; i < n; ++i)
+        bst.insert(random());
+    std::vector<int> probes(n);
+    for (auto &x : probes)
+        x = random();
+
+    auto t0 = clock::now();
+    auto seq = bst.flattern();
+    auto t1 = clock::now();
+    impl::static_index index(bst);
+    auto t2 = clock::now();
+    index.rebuild(bst);
+    auto t3 = clock::now();
+    std::cout << bst.size() << " keys: flattern " << ms(t1 - t0) << " ms, build " << ms(t2 - t1) << " ms, rebuild "
+              << ms(t3 - t2) << " ms" << std::endl;
+
+    long sum = 0;
+    auto run = [&](const char *name, auto &&lookup) {
+        auto t = clock::now();
+        for (int x : probes)
+            sum += lookup(x);
+        std::cout << name << ": " << ms(clock::now() - t) * 1e6 / n << " ns per lookup" << std::endl;
+    };
+    run("bstree (avl)     ", [&](int x) { return bst.search(x) != nullptr; });
+    run("std::lower_bound ", [&](int x) {
+        auto it = std::lower_bound(seq.begin(), seq.end(), x);
+        return it != seq.end() && *it == x;
+    });
+    run("static_index     ", [&](int x) { return index.search(x); });
+    std::cout << "(" << sum << " found)" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    test_small();
+    test_rebuild();
+    bench(argc > 1 ? atoi(argv[1]) : 1000000);
+}
@@ -0,0 +1,211 @@
+/* A shared_ptr which can be loaded and stored by several threads at once, without a mutex.
+ *
+ * Split reference counts: the atomic word packs the control block pointer (low 48 bits) with a local count
+ * (high 16 bits). When a pointer is stored, 'batch' references are added to its shared count in advance, and
+ * a 'load' takes one of them by raising the local count: one CAS on the atomic word, the control block is
+ * not touched. So at any time the atomic_shared_ptr owns 'batch - local count' references. The loader which
+ * brings the local count to 'batch / 2' moves that many references to the shared count, so it never overflows.
+ * A 'store' swaps the word, and returns the references of the old block which no load has taken.
+ * Note: use_count() of a stored object includes the references held in advance.
+ *
+ * Readers of a value which rarely changes (configuration, routing tables) can avoid even the CAS, which bounces
+ * the cache line of the atomic word between cores: a snapshot_reader keeps a copy, and reloads it only when
+ * the version of the atomic_shared_ptr has changed, a load of a cache line that stays shared.
+ *
+ * Requires pointers which fit in 48 bits, as on x86-64 and AArch64 (user space).
+ */
+#pragma once
+#include "shared_ptr.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <thread>
+
+namespace impl
+{
+template <class T> class atomic_shared_ptr
+{
+    static_assert(sizeof(uintptr_t) == 8, "the local count lives in the high bits of a 64-bit pointer");
+
+  public:
+    using value_type = shared_ptr<T, atomic_count>;
+
+    atomic_shared_ptr() noexcept : word(0), ver(0)
+    {
+    }
+
+    explicit atomic_shared_ptr(value_type sp) : word(pack(prepay(sp))), ver(0)
+    {
+    }
+
+    atomic_shared_ptr(const atomic_shared_ptr &) = delete;
+    atomic_shared_ptr &operator=(const atomic_shared_ptr &) = delete;
+
+    ~atomic_shared_ptr()
+    {
+        release(word.load(std::memory_order_acquire));
+    }
+
+    value_type load() const
+    {
+        uintptr_t cur = word.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (block(cur) == nullptr)
+                return value_type();
+            if (local(cur) == max_local)
+            {
+                // Loaders are moving references to the shared count, wait for them
+                std::this_thread::yield();
+                cur = word.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (word.compare_exchange_weak(cur, cur + one_local, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+        }
+
+        ctl_type *ctl = block(cur);
+        if (local(cur) + 1 == batch / 2)
+            refill(ctl, cur + one_local);
+        return adopt(ctl);
+    }
+
+    void store(value_type sp)
+    {
+        exchange(std::move(sp));
+    }
+
+    value_type exchange(value_type sp)
+    {
+        uintptr_t old = word.exchange(pack(prepay(sp)), std::memory_order_acq_rel);
+        ver.fetch_add(1, std::memory_order_release);
+        value_type res = block(old) != nullptr ? adopt(block(old)) : value_type();
+        // 'res' took one reference, the loads took 'local(old)'
+        if (block(old) != nullptr)
+            block(old)->release_shared(batch - 1 - (int)local(old));
+        return res;
+    }
+
+    // Store 'desired' if the stored pointer is 'expected' (the same control block), otherwise load it into
+    // 'expected'. A changed local count alone does not make it fail.
+    bool compare_exchange_strong(value_type &expected, value_type desired)
+    {
+        ctl_type *want = expected.ctl;
+        uintptr_t next = pack(prepay(desired));
+        uintptr_t cur = word.load(std::memory_order_relaxed);
+        while (block(cur) == want)
+        {
+            if (word.compare_exchange_weak(cur, next, std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                ver.fetch_add(1, std::memory_order_release);
+                release(cur);
+                return true;
+            }
+        }
+
+        // 'desired' is still owned by the caller, give back its references in advance
+        if (block(next) != nullptr)
+            block(next)->release_shared(batch);
+        expected = load();
+        return false;
+    }
+
+    // Bumped by every store, for snapshot_reader
+    uint64_t version() const noexcept
+    {
+        return ver.load(std::memory_order_acquire);
+    }
+
+  private:
+    using ctl_type = ctl_block_base<atomic_count>;
+
+    static constexpr int local_shift = 48;
+    static constexpr uintptr_t one_local = uintptr_t(1) << local_shift;
+    static constexpr uintptr_t ptr_mask = one_local - 1;
+    static constexpr uintptr_t max_local = (uintptr_t(1) << (64 - local_shift)) - 1;
+    static constexpr int batch = 1 << (64 - local_shift);
+
+    static ctl_type *block(uintptr_t w) noexcept
+    {
+        return reinterpret_cast<ctl_type *>(w & ptr_mask);
+    }
+
+    static uintptr_t local(uintptr_t w) noexcept
+    {
+        return w >> local_shift;
+    }
+
+    static uintptr_t pack(ctl_type *ctl) noexcept
+    {
+        auto w = reinterpret_cast<uintptr_t>(ctl);
+        assert((w & ~ptr_mask) == 0);
+        return w;
+    }
+
+    // Turn the reference of 'sp' into 'batch' references owned by the atomic_shared_ptr
+    static ctl_type *prepay(value_type &sp) noexcept
+    {
+        ctl_type *ctl = sp.ctl;
+        if (ctl != nullptr)
+            atomic_count::increment(ctl->shared_cnt, batch - 1);
+        sp.ptr = nullptr, sp.ctl = nullptr;
+        return ctl;
+    }
+
+    // Give back the references of a word which has been swapped out
+    static void release(uintptr_t w) noexcept
+    {
+        if (block(w) != nullptr)
+            block(w)->release_shared(batch - (int)local(w));
+    }
+
+    // The local count of 'ctl' has reached batch / 2: move batch / 2 references to the shared count. If the
+    // word has been swapped meanwhile, the store has settled the count already and we take them back. The
+    // same block may have been stored again since, then the local count is a new one, and may be too low.
+    void refill(ctl_type *ctl, uintptr_t cur) const
+    {
+        constexpr int n = batch / 2;
+        atomic_count::increment(ctl->shared_cnt, n);
+        while (block(cur) == ctl && local(cur) >= n)
+        {
+            if (word.compare_exchange_weak(cur, cur - n * one_local, std::memory_order_relaxed))
+                return;
+        }
+        ctl->release_shared(n);
+    }
+
+    static value_type adopt(ctl_type *ctl)
+    {
+        return value_type(typename value_type::adopt_tag(), static_cast<T *>(ctl->object), ctl);
+    }
+
+    mutable std::atomic<uintptr_t> word;
+    std::atomic<uint64_t> ver;
+};
+
+/* A per-thread cache of the value of an atomic_shared_ptr. 'get' costs a load of the version as long as the
+ * value has not changed. The cached copy keeps the old object alive until the next 'get' after a store.
+ */
+template <class T> class snapshot_reader
+{
+  public:
+    explicit snapshot_reader(const atomic_shared_ptr<T> &src) : src(src), seen(src.version()), cached(src.load())
+    {
+    }
+
+    const shared_ptr<T, atomic_count> &get()
+    {
+        // The version is read first: a store that bumps it has swapped the pointer already
+        uint64_t v = src.version();
+        if (v != seen)
+            cached = src.load(), seen = v;
+        return cached;
+    }
+
+  private:
+    const atomic_shared_ptr<T> &src;
+    uint64_t seen;
+    shared_ptr<T, atomic_count> cached;
+};
+} // namespace impl
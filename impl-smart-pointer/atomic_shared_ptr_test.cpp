@@ -0,0 +1,160 @@
+#include "atomic_shared_ptr.hpp"
+#include <assert.h>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::atomic<int> alive(0);
+
+struct Config
+{
+    int version;
+    explicit Config(int version) : version(version)
+    {
+        alive.fetch_add(1);
+    }
+    ~Config()
+    {
+        alive.fetch_sub(1);
+    }
+};
+
+void test_atomic_shared_ptr()
+{
+    using ptr = impl::shared_ptr<Config>;
+    {
+        // Case 1: store, load, exchange
+        impl::atomic_shared_ptr<Config> a;
+        assert(a.load().get() == nullptr);
+        ptr first = impl::make_shared<Config>(1);
+        a.store(first);
+        assert(a.load()->version == 1 && a.load().get() == first.get());
+        ptr old = a.exchange(impl::make_shared<Config>(2));
+        assert(old.get() == first.get() && a.load()->version == 2);
+
+        // Case 2: compare_exchange, by control block
+        ptr expected = first;
+        assert(!a.compare_exchange_strong(expected, impl::make_shared<Config>(3)));
+        assert(expected->version == 2);
+        assert(a.compare_exchange_strong(expected, impl::make_shared<Config>(4)));
+        expected = nullptr, old = nullptr;
+        assert(a.load()->version == 4 && alive.load() == 2);
+
+        // Case 3: the references taken in advance are given back, over many refills of the local count
+        for (int i = 0; i < 200000; ++i)
+            assert(a.load()->version == 4);
+        std::vector<ptr> held(70000, a.load());
+        for (auto &p : held)
+            p = a.load();
+        a.store(first);
+        assert(alive.load() == 2 && held[0].use_count() == 70000);
+        held.clear();
+        assert(alive.load() == 1);
+        a.store(nullptr);
+        assert(first.use_count() == 1);
+    }
+    assert(alive.load() == 0);
+}
+
+// Readers check that every snapshot is consistent while a writer replaces it, nothing leaks
+void test_concurrent()
+{
+    {
+        impl::atomic_shared_ptr<Config> a(impl::make_shared<Config>(0));
+        std::atomic<bool> done(false);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t)
+        {
+            readers.emplace_back([&]() {
+                impl::snapshot_reader<Config> reader(a);
+                int last = 0;
+                while (!done.load())
+                {
+                    auto p = a.load();
+                    assert(p->version >= last);
+                    last = p->version;
+                    assert(reader.get()->version >= 0);
+                }
+            });
+        }
+        for (int v = 1; v <= 20000; ++v)
+        {
+            if (v % 2)
+                a.store(impl::make_shared<Config>(v));
+            else
+            {
+                auto expected = a.load();
+                assert(a.compare_exchange_strong(expected, impl::make_shared<Config>(v)));
+            }
+        }
+        done = true;
+        for (auto &t : readers)
+            t.join();
+        assert(a.load()->version == 20000);
+    }
+    assert(alive.load() == 0);
+}
+
+// Loads per microsecond, all threads together, of a value which does not change
+void bench_readers()
+{
+    constexpr int N = 1 << 20;
+    impl::atomic_shared_ptr<Config> a(impl::make_shared<Config>(1));
+    std::mutex mtx;
+    impl::shared_ptr<Config> locked = impl::make_shared<Config>(1);
+
+    auto run = [&](int nr_threads, auto &&read) {
+        std::vector<std::thread> threads;
+        std::atomic<long> sum(0);
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < nr_threads; ++t)
+        {
+            threads.emplace_back([&]() {
+                long local = 0;
+                read(local);
+                sum.fetch_add(local);
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        auto cost = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        assert(sum.load() == (long)nr_threads * N);
+        return nr_threads * (double)N / cost;
+    };
+
+    int max_threads = std::max(4u, std::thread::hardware_concurrency());
+    for (int nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2)
+    {
+        double with_mutex = run(nr_threads, [&](long &sum) {
+            for (int i = 0; i < N; ++i)
+            {
+                impl::shared_ptr<Config> p;
+                {
+                    std::unique_lock lock(mtx);
+                    p = locked;
+                }
+                sum += p->version;
+            }
+        });
+        double with_load = run(nr_threads, [&](long &sum) {
+            for (int i = 0; i < N; ++i)
+                sum += a.load()->version;
+        });
+        double with_reader = run(nr_threads, [&](long &sum) {
+            impl::snapshot_reader<Config> reader(a);
+            for (int i = 0; i < N; ++i)
+                sum += reader.get()->version;
+        });
+        std::printf("threads = %2d, loads/us: mutex = %7.1f, load = %7.1f, snapshot_reader = %8.1f\n", nr_threads,
+                    with_mutex, with_load, with_reader);
+    }
+}
+
+int main()
+{
+    test_atomic_shared_ptr();
+    test_concurrent();
+    bench_readers();
+}
@@ -0,0 +1,156 @@
+/* A reference counted pointer whose count lives inside the object.
+ * - Derive T from intrusive_ref_counter<T> (atomic count) or intrusive_ref_counter<T, single_thread_count>.
+ * - intrusive_ptr<T> is one pointer, and a copy touches the object only: no control block, no extra cache line.
+ * - The object is freed by 'T::intrusive_destroy(T *)', which is 'delete' unless T declares its own (e.g. to
+ *   give the object back to a pool). It is found at compile time, no virtual call.
+ * Any other class can be used too, by providing 'intrusive_ptr_add_ref(T *)' and 'intrusive_ptr_release(T *)'.
+ *
+ * e.g.
+ *     struct Node : impl::intrusive_ref_counter<Node>
+ *     {
+ *         static void intrusive_destroy(Node *p) { pool.free(p); }
+ *     };
+ *     impl::intrusive_ptr<Node> p(new (pool.alloc()) Node());
+ */
+#pragma once
+#include "shared_ptr.hpp" // using atomic_count and single_thread_count
+
+#include <utility>
+
+namespace impl
+{
+template <class Derived, class Policy = atomic_count> class intrusive_ref_counter
+{
+  private:
+    mutable typename Policy::type refs;
+
+    // Hidden friends, found by argument-dependent lookup from intrusive_ptr
+    friend void intrusive_ptr_add_ref(const Derived *p) noexcept
+    {
+        Policy::increment(p->intrusive_ref_counter::refs);
+    }
+
+    friend void intrusive_ptr_release(const Derived *p) noexcept
+    {
+        if (Policy::decrement(p->intrusive_ref_counter::refs))
+            Derived::intrusive_destroy(const_cast<Derived *>(p));
+    }
+
+  protected:
+    intrusive_ref_counter() noexcept : refs(0)
+    {
+    }
+
+    // A copy is a new object, nobody refers to it yet
+    intrusive_ref_counter(const intrusive_ref_counter &) noexcept : refs(0)
+    {
+    }
+
+    intrusive_ref_counter &operator=(const intrusive_ref_counter &) noexcept
+    {
+        return *this;
+    }
+
+    ~intrusive_ref_counter() = default;
+
+  public:
+    // The default destroy hook, T hides it with its own
+    static void intrusive_destroy(Derived *p) noexcept
+    {
+        delete p;
+    }
+
+    int use_count() const noexcept
+    {
+        return Policy::load(refs);
+    }
+};
+
+template <class T> class intrusive_ptr
+{
+  private:
+    T *ptr;
+
+  public:
+    intrusive_ptr() noexcept : ptr(nullptr)
+    {
+    }
+
+    // 'add_ref = false' adopts a reference which has been taken already (see 'detach')
+    intrusive_ptr(T *p, bool add_ref = true) : ptr(p)
+    {
+        if (ptr != nullptr && add_ref)
+            intrusive_ptr_add_ref(ptr);
+    }
+
+    intrusive_ptr(const intrusive_ptr &ip) : ptr(ip.ptr)
+    {
+        if (ptr != nullptr)
+            intrusive_ptr_add_ref(ptr);
+    }
+
+    intrusive_ptr(intrusive_ptr &&ip) noexcept : ptr(ip.ptr)
+    {
+        ip.ptr = nullptr;
+    }
+
+    ~intrusive_ptr()
+    {
+        if (ptr != nullptr)
+            intrusive_ptr_release(ptr);
+    }
+
+    intrusive_ptr &operator=(const intrusive_ptr &ip)
+    {
+        intrusive_ptr(ip).swap(*this);
+        return *this;
+    }
+
+    intrusive_ptr &operator=(intrusive_ptr &&ip) noexcept
+    {
+        intrusive_ptr(std::move(ip)).swap(*this);
+        return *this;
+    }
+
+    void reset(T *p = nullptr)
+    {
+        intrusive_ptr(p).swap(*this);
+    }
+
+    // Give up the reference without releasing it
+    T *detach() noexcept
+    {
+        return std::exchange(ptr, nullptr);
+    }
+
+    void swap(intrusive_ptr &ip) noexcept
+    {
+        std::swap(ptr, ip.ptr);
+    }
+
+    T *get() const noexcept
+    {
+        return ptr;
+    }
+
+    T *operator->() const noexcept
+    {
+        return ptr;
+    }
+
+    T &operator*() const noexcept
+    {
+        return *ptr;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr != nullptr;
+    }
+};
+
+template <class T, class... Args> intrusive_ptr<T> make_intrusive(Args &&...args)
+{
+    return intrusive_ptr<T>(new T(std::forward<Args>(args)...));
+}
+} // namespace impl
@@ -1,91 +1,338 @@
 /* Implement shared_ptr of STL */
 
 #pragma once
-#include <functional>
+#include <atomic>
+#include <cstddef>
 #include <memory>
+#include <new>
 #include <stdint.h>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SANITIZE_THREAD__)
+#define IMPL_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define IMPL_TSAN 1
+#endif
+#endif
+#ifndef IMPL_TSAN
+#define IMPL_TSAN 0
+#endif
 
 namespace impl
 {
 template <class T> struct default_deleter
 {
-    void operator()(T *p)
+    void operator()(T *p) const
     {
         delete p;
     }
 };
 
-/* Control Block for shared_ptr */
-template <class T> class ctl_block
+template <class T> struct default_deleter<T[]>
+{
+    void operator()(T *p) const
+    {
+        delete[] p;
+    }
+};
+
+/* Holds a 'D' (a deleter, an allocator), and takes no room when 'D' is an empty class: it is a base class
+ * then (empty base optimization). A class holding one derives from it and reads it with 'held()'.
+ */
+template <class D, bool = std::is_empty_v<D> && !std::is_final_v<D>> class ebo_holder
+{
+  private:
+    D value;
+
+  public:
+    explicit ebo_holder(D v) : value(std::move(v))
+    {
+    }
+
+    D &held() noexcept
+    {
+        return value;
+    }
+
+    const D &held() const noexcept
+    {
+        return value;
+    }
+};
+
+template <class D> class ebo_holder<D, true> : private D
 {
   public:
-    int shared_cnt;
-    std::function<void(T *)> deleter;
-    ctl_block(std::function<void(T *)> del) : shared_cnt(1), deleter(del)
+    explicit ebo_holder(D v) : D(std::move(v))
+    {
+    }
+
+    D &held() noexcept
+    {
+        return *this;
+    }
+
+    const D &held() const noexcept
+    {
+        return *this;
+    }
+};
+
+/* How the reference counts of a control block are updated.
+ * - atomic_count (the default): a shared_ptr may be copied and destroyed by several threads at once. A copy
+ *   is a relaxed increment, since it is made from an existing reference which keeps the object alive. The
+ *   decrement is a release, and the last one is followed by an acquire fence, so that whatever a thread did to
+ *   the object happens before it is destroyed.
+ * - single_thread_count: plain integers, for objects which never cross threads.
+ */
+struct atomic_count
+{
+    using type = std::atomic<int>;
+
+    static void increment(type &cnt, int n = 1) noexcept
+    {
+        cnt.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Return true if these were the last references
+    static bool decrement(type &cnt, int n = 1) noexcept
+    {
+        if (cnt.fetch_sub(n, std::memory_order_release) != n)
+            return false;
+#if IMPL_TSAN
+        // TSan does not model fences, an acquire load of the count synchronizes with the same releases
+        cnt.load(std::memory_order_acquire);
+#else
+        std::atomic_thread_fence(std::memory_order_acquire);
+#endif
+        return true;
+    }
+
+    // For weak_ptr::lock, the object must not be revived once the count has dropped to 0
+    static bool increment_if_nonzero(type &cnt) noexcept
     {
+        int n = cnt.load(std::memory_order_relaxed);
+        while (n != 0)
+        {
+            if (cnt.compare_exchange_weak(n, n + 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
+    static int load(const type &cnt) noexcept
+    {
+        return cnt.load(std::memory_order_relaxed);
     }
 };
 
-template <class T> class shared_ptr
+struct single_thread_count
+{
+    using type = int;
+
+    static void increment(type &cnt, int n = 1) noexcept
+    {
+        cnt += n;
+    }
+
+    static bool decrement(type &cnt, int n = 1) noexcept
+    {
+        return (cnt -= n) == 0;
+    }
+
+    static bool increment_if_nonzero(type &cnt) noexcept
+    {
+        return cnt != 0 && ++cnt;
+    }
+
+    static int load(const type &cnt) noexcept
+    {
+        return cnt;
+    }
+};
+
+/* Control Block for shared_ptr, the part which does not depend on how the object is stored.
+ * - dispose: destroy the object, when the last shared_ptr goes away.
+ * - destroy: free the control block itself.
+ * The deleter is only known to the derived blocks, so these two virtual calls are its only type erasure:
+ * shared_ptr itself is two plain pointers.
+ * 'weak_cnt' counts the weak_ptrs, plus one for all the shared_ptrs together: the object is disposed when
+ * 'shared_cnt' drops to 0, and the block is destroyed when 'weak_cnt' does.
+ * 'object' is the managed object, so that the block alone is enough to rebuild a shared_ptr (see
+ * atomic_shared_ptr.hpp).
+ */
+template <class Policy> class ctl_block_base
+{
+  public:
+    typename Policy::type shared_cnt, weak_cnt;
+    void *object;
+
+    explicit ctl_block_base(void *object) : shared_cnt(1), weak_cnt(1), object(object)
+    {
+    }
+
+    void release_shared(int n = 1) noexcept
+    {
+        if (Policy::decrement(shared_cnt, n))
+        {
+            dispose();
+            release_weak();
+        }
+    }
+
+    void release_weak() noexcept
+    {
+        if (Policy::decrement(weak_cnt))
+            destroy();
+    }
+
+    virtual void dispose() noexcept = 0;
+
+    virtual void destroy() noexcept
+    {
+        delete this;
+    }
+
+  protected:
+    virtual ~ctl_block_base() = default;
+};
+
+/* The object is allocated by the user, and freed by a 'Deleter', which takes no room if it is stateless. */
+template <class T, class Deleter, class Policy>
+class ctl_block : public ctl_block_base<Policy>, private ebo_holder<Deleter>
+{
+  public:
+    ctl_block(T *p, Deleter del)
+        : ctl_block_base<Policy>(const_cast<std::remove_cv_t<T> *>(p)), ebo_holder<Deleter>(std::move(del))
+    {
+    }
+
+    void dispose() noexcept override
+    {
+        this->held()(static_cast<T *>(this->object));
+    }
+};
+
+/* For make_shared: the object lives right after the counter, in the same allocation, so the first access to
+ * the object and to the counter usually hit the same cache line.
+ */
+template <class T, class Policy> class inplace_ctl_block : public ctl_block_base<Policy>
+{
+  private:
+    alignas(T) unsigned char storage[sizeof(T)];
+
+  public:
+    template <class... Args> explicit inplace_ctl_block(Args &&...args) : ctl_block_base<Policy>(storage)
+    {
+        new (storage) T(std::forward<Args>(args)...);
+    }
+
+    T *get() noexcept
+    {
+        return std::launder(reinterpret_cast<T *>(storage));
+    }
+
+    void dispose() noexcept override
+    {
+        get()->~T();
+    }
+};
+
+template <class T, class Policy = atomic_count> class shared_ptr;
+template <class T, class Policy = atomic_count> class weak_ptr;
+template <class T, class Policy = atomic_count> class enable_shared_from_this;
+template <class T> class atomic_shared_ptr;
+template <class T, class Policy = atomic_count, class... Args> shared_ptr<T, Policy> make_shared(Args &&...args);
+
+template <class T, class Policy> class shared_ptr
 {
   private:
     T *ptr;
-    ctl_block<T> *ctl;
+    ctl_block_base<Policy> *ctl; // nullptr for an empty shared_ptr
 
     void clear()
     {
-        if (--(ctl->shared_cnt) == 0)
-        {
-            if (ptr != nullptr)
-                ctl->deleter(ptr);
-            delete ctl;
-            ptr = nullptr, ctl = nullptr;
-        }
+        if (ctl != nullptr)
+            ctl->release_shared();
+        ptr = nullptr, ctl = nullptr;
+    }
+
+    // Adopt 'ctl', whose count already includes this shared_ptr
+    struct adopt_tag
+    {
+    };
+    shared_ptr(adopt_tag, T *p, ctl_block_base<Policy> *ctl) : ptr(p), ctl(ctl)
+    {
+        hook_shared_from_this(p);
+    }
+
+    // If T derives from enable_shared_from_this, point its weak reference at this new owner
+    template <class U> void hook_shared_from_this(const enable_shared_from_this<U, Policy> *base)
+    {
+        if (base != nullptr && base->weak_this.expired())
+            base->weak_this.assign(static_cast<U *>(ptr), ctl);
+    }
+
+    void hook_shared_from_this(...)
+    {
     }
 
+    template <class U, class P, class... Args> friend shared_ptr<U, P> make_shared(Args &&...args);
+    friend class weak_ptr<T, Policy>;
+    friend class atomic_shared_ptr<T>;
+
   public:
-    // Default ctor and common ctor
-    shared_ptr(T *p = nullptr, std::function<void(T *)> del = default_deleter<T>()) : ptr(p), ctl(new ctl_block(del))
+    // Default ctor, no control block is allocated for nullptr
+    shared_ptr(std::nullptr_t = nullptr) noexcept : ptr(nullptr), ctl(nullptr)
     {
     }
 
-    // Default dtor
-    virtual ~shared_ptr()
+    // Common ctor, 'del' is any callable taking a 'T *'
+    template <class Deleter = default_deleter<T>>
+    shared_ptr(T *p, Deleter del = Deleter())
+        : ptr(p), ctl(p != nullptr ? new ctl_block<T, Deleter, Policy>(p, std::move(del)) : nullptr)
     {
-        if (ctl != nullptr && ctl->shared_cnt > 0)
-            clear();
+        hook_shared_from_this(p);
+    }
+
+    // Default dtor, not virtual: a vptr would make every handle a pointer bigger
+    ~shared_ptr()
+    {
+        clear();
     }
 
     // Copy ctor
-    shared_ptr(const shared_ptr<T> &sp)
+    shared_ptr(const shared_ptr &sp)
     {
         ptr = sp.ptr, ctl = sp.ctl;
-        if (ptr != nullptr)
-            ++(ctl->shared_cnt);
+        if (ctl != nullptr)
+            Policy::increment(ctl->shared_cnt);
     }
 
     // Move ctor
-    shared_ptr(shared_ptr<T> &&sp)
+    shared_ptr(shared_ptr &&sp) noexcept
     {
         ptr = sp.ptr, ctl = sp.ctl;
         sp.ptr = nullptr, sp.ctl = nullptr;
     }
 
     // Copy assignment
-    shared_ptr &operator=(const shared_ptr<T> &sp)
+    shared_ptr &operator=(const shared_ptr &sp)
     {
         if (this != &sp)
         {
             clear();
             ptr = sp.ptr, ctl = sp.ctl;
-            if (ptr != nullptr)
-                ++(ctl->shared_cnt);
+            if (ctl != nullptr)
+                Policy::increment(ctl->shared_cnt);
         }
         return *this;
     }
 
     // Move assignment
-    shared_ptr &operator=(shared_ptr<T> &&sp)
+    shared_ptr &operator=(shared_ptr &&sp) noexcept
     {
         if (this != &sp)
         {
@@ -98,7 +345,7 @@ template <class T> class shared_ptr
 
     int use_count() const
     {
-        return ctl->shared_cnt;
+        return ctl != nullptr ? Policy::load(ctl->shared_cnt) : 0;
     }
 
     T *operator->() const
@@ -110,5 +357,163 @@ template <class T> class shared_ptr
     {
         return ptr;
     }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr != nullptr;
+    }
+};
+
+/* A non-owning reference to an object owned by shared_ptrs. It keeps the control block alive (not the object),
+ * and 'lock' makes a shared_ptr out of it if the object still exists.
+ */
+template <class T, class Policy> class weak_ptr
+{
+  private:
+    T *ptr;
+    ctl_block_base<Policy> *ctl; // nullptr for an empty weak_ptr
+
+    void clear()
+    {
+        if (ctl != nullptr)
+            ctl->release_weak();
+        ptr = nullptr, ctl = nullptr;
+    }
+
+    void assign(T *p, ctl_block_base<Policy> *c)
+    {
+        if (c != nullptr)
+            Policy::increment(c->weak_cnt);
+        clear();
+        ptr = p, ctl = c;
+    }
+
+    template <class U, class P> friend class shared_ptr;
+
+  public:
+    weak_ptr() noexcept : ptr(nullptr), ctl(nullptr)
+    {
+    }
+
+    weak_ptr(const shared_ptr<T, Policy> &sp) : weak_ptr()
+    {
+        assign(sp.ptr, sp.ctl);
+    }
+
+    weak_ptr(const weak_ptr &wp) : weak_ptr()
+    {
+        assign(wp.ptr, wp.ctl);
+    }
+
+    weak_ptr(weak_ptr &&wp) noexcept : ptr(wp.ptr), ctl(wp.ctl)
+    {
+        wp.ptr = nullptr, wp.ctl = nullptr;
+    }
+
+    ~weak_ptr()
+    {
+        clear();
+    }
+
+    weak_ptr &operator=(const weak_ptr &wp)
+    {
+        if (this != &wp)
+            assign(wp.ptr, wp.ctl);
+        return *this;
+    }
+
+    weak_ptr &operator=(weak_ptr &&wp) noexcept
+    {
+        if (this != &wp)
+        {
+            clear();
+            ptr = wp.ptr, ctl = wp.ctl;
+            wp.ptr = nullptr, wp.ctl = nullptr;
+        }
+        return *this;
+    }
+
+    weak_ptr &operator=(const shared_ptr<T, Policy> &sp)
+    {
+        assign(sp.ptr, sp.ctl);
+        return *this;
+    }
+
+    void reset()
+    {
+        clear();
+    }
+
+    int use_count() const
+    {
+        return ctl != nullptr ? Policy::load(ctl->shared_cnt) : 0;
+    }
+
+    // Only a hint with several threads, the last owner may go away right after
+    bool expired() const
+    {
+        return use_count() == 0;
+    }
+
+    // An owner of the object, or an empty shared_ptr if it has been destroyed
+    shared_ptr<T, Policy> lock() const
+    {
+        if (ctl == nullptr || !Policy::increment_if_nonzero(ctl->shared_cnt))
+            return shared_ptr<T, Policy>();
+        return shared_ptr<T, Policy>(typename shared_ptr<T, Policy>::adopt_tag(), ptr, ctl);
+    }
 };
+
+/* Derive T from enable_shared_from_this<T> to get a shared_ptr from a member function of T. The shared_ptr
+ * which takes ownership of the object (or make_shared) fills 'weak_this' in.
+ */
+template <class T, class Policy> class enable_shared_from_this
+{
+  private:
+    mutable weak_ptr<T, Policy> weak_this;
+
+    template <class U, class P> friend class shared_ptr;
+
+  protected:
+    enable_shared_from_this() = default;
+
+    // A copy is a new object, it is not owned by the owners of the original
+    enable_shared_from_this(const enable_shared_from_this &)
+    {
+    }
+
+    enable_shared_from_this &operator=(const enable_shared_from_this &)
+    {
+        return *this;
+    }
+
+    ~enable_shared_from_this() = default;
+
+  public:
+    // Throw std::bad_weak_ptr if the object is not owned by a shared_ptr
+    shared_ptr<T, Policy> shared_from_this() const
+    {
+        auto sp = weak_this.lock();
+        if (!sp)
+            throw std::bad_weak_ptr();
+        return sp;
+    }
+
+    weak_ptr<T, Policy> weak_from_this() const
+    {
+        return weak_this;
+    }
+};
+
+// Construct a T from 'args', in the same allocation as its control block
+// e.g. make_shared<Node>(1, 2), or make_shared<Node, single_thread_count>(1, 2)
+template <class T, class Policy, class... Args> shared_ptr<T, Policy> make_shared(Args &&...args)
+{
+    auto *ctl = new inplace_ctl_block<T, Policy>(std::forward<Args>(args)...);
+    return shared_ptr<T, Policy>(typename shared_ptr<T, Policy>::adopt_tag(), ctl->get(), ctl);
+}
+
+static_assert(sizeof(shared_ptr<int>) == 2 * sizeof(void *), "shared_ptr should be two pointers");
+static_assert(sizeof(ctl_block<int, default_deleter<int>, atomic_count>) == 3 * sizeof(void *),
+              "a stateless deleter should take no room in the control block");
 } // namespace impl
@@ -1,6 +1,38 @@
 #include "shared_ptr.hpp"
+#include "unique_ptr.hpp"
+#include <algorithm>
 #include <assert.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Count the heap allocations made by the current thread, to check that make_shared allocates once
+static thread_local size_t nr_allocs = 0;
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    ++nr_allocs;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
 
 class Node
 {
@@ -67,8 +99,239 @@ void test_shared_ptr()
         arr3.get()[i].print();
 }
 
+void test_make_shared()
+{
+    struct Point
+    {
+        int x, y;
+        Point(int x, int y) : x(x), y(y)
+        {
+        }
+    };
+
+    // Case 1: one allocation for the object and its control block
+    size_t before = nr_allocs;
+    auto p = impl::make_shared<Point>(1, 2);
+    assert(nr_allocs - before == 1);
+    assert(p->x == 1 && p->y == 2 && p.use_count() == 1);
+
+    // Case 2: copies share the count, the object is destroyed once
+    {
+        auto node = impl::make_shared<Node>();
+        impl::shared_ptr<Node> node2 = node;
+        assert(node.use_count() == 2 && node2.get() == node.get());
+        node2 = impl::shared_ptr<Node>();
+        assert(node.use_count() == 1 && node2.use_count() == 0);
+    } // ~Node() once
+
+    // Case 3: an object with a non-trivial destructor and alignment
+    struct alignas(32) Big
+    {
+        std::string s;
+    };
+    auto big = impl::make_shared<Big>(Big{std::string(100, 'x')});
+    assert(reinterpret_cast<uintptr_t>(big.get()) % 32 == 0 && big->s.size() == 100);
+}
+
+// Copies made and dropped by many threads at once, the object is destroyed once, by the last owner
+void test_atomic_count()
+{
+    static std::atomic<int> destroyed(0);
+    struct Counted
+    {
+        int value = 42;
+        ~Counted()
+        {
+            destroyed.fetch_add(1);
+        }
+    };
+
+    auto p = impl::make_shared<Counted>();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([p]() {
+            for (int i = 0; i < 100000; ++i)
+            {
+                impl::shared_ptr<Counted> copy = p;
+                assert(copy->value == 42);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    assert(p.use_count() == 1 && destroyed.load() == 0);
+    p = impl::shared_ptr<Counted>();
+    assert(destroyed.load() == 1);
+
+    // the single-threaded policy behaves the same on one thread
+    auto q = impl::make_shared<Counted, impl::single_thread_count>();
+    {
+        impl::shared_ptr<Counted, impl::single_thread_count> copy = q;
+        assert(q.use_count() == 2);
+    }
+    assert(q.use_count() == 1);
+}
+
+// A cache of weak references: entries do not keep the objects alive, and are dropped once they expire
+void test_weak_ptr()
+{
+    struct Entry : impl::enable_shared_from_this<Entry>
+    {
+        int key;
+        explicit Entry(int key) : key(key)
+        {
+        }
+    };
+
+    std::map<int, impl::weak_ptr<Entry>> cache;
+    auto lookup = [&](int key) {
+        if (auto hit = cache[key].lock())
+            return hit;
+        auto sp = impl::make_shared<Entry>(key);
+        cache[key] = sp;
+        return sp;
+    };
+
+    // Case 1: a hit while an owner exists, no extra owner is held by the cache
+    auto a = lookup(1);
+    auto b = lookup(1);
+    assert(a.get() == b.get() && a.use_count() == 2 && !cache[1].expired());
+
+    // Case 2: the object goes away with its last owner, the entry is expired and can be dropped
+    a = nullptr, b = nullptr;
+    assert(cache[1].expired() && cache[1].lock().get() == nullptr && cache[1].use_count() == 0);
+    for (auto it = cache.begin(); it != cache.end();)
+        it = it->second.expired() ? cache.erase(it) : std::next(it);
+    assert(cache.empty());
+
+    // Case 3: shared_from_this shares the ownership of the existing owners
+    auto c = lookup(2);
+    auto d = c->shared_from_this();
+    assert(d.get() == c.get() && c.use_count() == 2);
+    impl::shared_ptr<Entry> e(new Entry(3));
+    assert(e->shared_from_this().get() == e.get());
+    assert(e->weak_from_this().use_count() == 1);
+
+    // Case 4: an object not owned by a shared_ptr has nothing to share
+    Entry local(4);
+    bool thrown = false;
+    try
+    {
+        local.shared_from_this();
+    }
+    catch (const std::bad_weak_ptr &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // Case 5: a weak_ptr outlives the object, the block is freed with the last weak_ptr
+    impl::weak_ptr<Entry> w;
+    {
+        auto f = impl::make_shared<Entry>(5);
+        w = f;
+        impl::weak_ptr<Entry> w2 = w;
+        assert(w2.lock()->key == 5);
+    }
+    assert(w.expired());
+    w.reset();
+
+    // Case 6: 'lock' racing with the release of the last owner never revives the object
+    for (int round = 0; round < 100; ++round)
+    {
+        auto owner = impl::make_shared<Entry>(round);
+        impl::weak_ptr<Entry> weak = owner;
+        std::thread t([weak]() {
+            while (auto sp = weak.lock())
+                assert(sp->key >= 0);
+        });
+        owner = nullptr;
+        t.join();
+    }
+}
+
+// Copy-assign into a ring of handles, from 'a' and 'b' in turn: each assignment increments one count and
+// decrements the other
+template <class Ptr> double copy_loop(const Ptr &a, const Ptr &b, int n)
+{
+    std::vector<Ptr> ring(64, a);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i)
+        ring[i & 63] = (i & 64) ? a : b;
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+}
+
+// The cost of a copy plus a destroy, on one thread and with all threads on the same two counts
+void bench_refcount()
+{
+    constexpr int N = 1 << 22;
+    auto std_a = std::make_shared<int>(1), std_b = std::make_shared<int>(2);
+    auto atomic_a = impl::make_shared<int>(1), atomic_b = impl::make_shared<int>(2);
+    auto single_a = impl::make_shared<int, impl::single_thread_count>(1);
+    auto single_b = impl::make_shared<int, impl::single_thread_count>(2);
+    std::printf("one thread: std::shared_ptr = %.2f ns, atomic_count = %.2f ns, single_thread_count = %.2f ns\n",
+                copy_loop(std_a, std_b, N), copy_loop(atomic_a, atomic_b, N), copy_loop(single_a, single_b, N));
+
+    auto contended = [](const auto &a, const auto &b, int nr_threads) {
+        std::vector<std::thread> threads;
+        std::vector<double> cost(nr_threads);
+        for (int t = 0; t < nr_threads; ++t)
+            threads.emplace_back([&, t]() { cost[t] = copy_loop(a, b, N / nr_threads); });
+        for (auto &t : threads)
+            t.join();
+        double sum = 0;
+        for (double c : cost)
+            sum += c;
+        return sum / nr_threads;
+    };
+    int nr_threads = std::max(4u, std::thread::hardware_concurrency());
+    std::printf("%d threads, shared counts: std::shared_ptr = %.2f ns, atomic_count = %.2f ns\n", nr_threads,
+                contended(std_a, std_b, nr_threads), contended(atomic_a, atomic_b, nr_threads));
+}
+
+// What the handles and the control block cost: create/destroy with a custom deleter, and moving handles around
+void bench_layout()
+{
+    constexpr int N = 1 << 20;
+    auto measure = [](auto &&fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / N;
+    };
+    auto del = [](int *p) { delete p; };
+
+    double std_cost = measure([&]() {
+        for (int i = 0; i < N; ++i)
+            std::shared_ptr<int> p(new int(i), del);
+    });
+    double impl_cost = measure([&]() {
+        for (int i = 0; i < N; ++i)
+            impl::shared_ptr<int> p(new int(i), del);
+    });
+    std::printf("shared_ptr: sizeof = %zu, new + custom deleter: std = %.2f ns, impl = %.2f ns\n",
+                sizeof(impl::shared_ptr<int>), std_cost, impl_cost);
+
+    // std::sort moves the handles only
+    auto sort_handles = [&](auto make) {
+        std::vector<decltype(make(0))> v;
+        for (int i = 0; i < N; ++i)
+            v.emplace_back(make(int((i * 7919LL) % N)));
+        return measure([&]() { std::sort(v.begin(), v.end(), [](auto &a, auto &b) { return *a.get() < *b.get(); }); });
+    };
+    std_cost = sort_handles([](int x) { return std::unique_ptr<int>(new int(x)); });
+    impl_cost = sort_handles([](int x) { return impl::unique_ptr<int>(new int(x)); });
+    std::printf("unique_ptr: sizeof = %zu, sort: std = %.2f ns, impl = %.2f ns per element\n",
+                sizeof(impl::unique_ptr<int>), std_cost, impl_cost);
+}
+
 int main()
 {
     test_shared_ptr();
+    test_make_shared();
+    test_atomic_count();
+    test_weak_ptr();
+    bench_refcount();
+    bench_layout();
     return 0;
 }
\ No newline at end of file
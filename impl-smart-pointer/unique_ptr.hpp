@@ -1,21 +1,25 @@
 #pragma once
-#include "shared_ptr.hpp" // using the default_deleter
+#include "shared_ptr.hpp" // using the default_deleter and ebo_holder
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
 namespace impl
 {
-template <class T, class Deleter = default_deleter<T>> class unique_ptr
+// The deleter is held as an empty base when it is stateless, so unique_ptr<T> is as big as a 'T *'
+template <class T, class Deleter = default_deleter<T>> class unique_ptr : private ebo_holder<Deleter>
 {
   private:
     T *ptr;
-    Deleter deleter;
 
     void clear()
     {
         if (ptr != nullptr)
         {
-            deleter(ptr);
+            this->held()(ptr);
             ptr = nullptr;
         }
     }
@@ -24,46 +28,257 @@ template <class T, class Deleter = default_deleter<T>> class unique_ptr
     unique_ptr(const unique_ptr &) = delete;
     unique_ptr &operator=(const unique_ptr &) = delete;
 
-    // dtor
-    virtual ~unique_ptr()
+    // dtor, not virtual: a vptr would double the size of the handle
+    ~unique_ptr()
     {
         clear();
     }
 
     // Default ctor and common ctor
-    explicit unique_ptr(T *p = nullptr, Deleter del = default_deleter<T>()) : ptr(p), deleter(del)
+    explicit unique_ptr(T *p = nullptr, Deleter del = Deleter()) : ebo_holder<Deleter>(std::move(del)), ptr(p)
     {
     }
 
     // std::move ctor
     // Can not declare it with 'explicit', see case-1 of 'unique_ptr_test'
-    unique_ptr(unique_ptr<T> &&up) noexcept
+    unique_ptr(unique_ptr &&up) noexcept : ebo_holder<Deleter>(std::move(up.held())), ptr(up.ptr)
     {
-        ptr = up.ptr, deleter = up.deleter;
         up.ptr = nullptr;
     }
 
-    unique_ptr &operator=(unique_ptr &&up)
+    unique_ptr &operator=(unique_ptr &&up) noexcept
     {
-        clear();
-        ptr = up.ptr, deleter = up.deleter;
-        up.ptr = nullptr;
+        if (this != &up)
+        {
+            clear();
+            ptr = up.ptr, this->held() = std::move(up.held());
+            up.ptr = nullptr;
+        }
         return *this;
     }
 
+    // Give up the ownership, the caller frees the object
+    T *release() noexcept
+    {
+        return std::exchange(ptr, nullptr);
+    }
+
+    void reset(T *p = nullptr)
+    {
+        T *old = std::exchange(ptr, p);
+        if (old != nullptr)
+            this->held()(old);
+    }
+
     T *get() const
     {
         return ptr;
     }
 
+    Deleter &get_deleter() noexcept
+    {
+        return this->held();
+    }
+
     T *operator->() const
     {
         return ptr;
     }
 
+    T &operator*() const
+    {
+        return *ptr;
+    }
+
     explicit operator bool() const noexcept
     {
         return ptr != nullptr;
     }
 };
-} // namespace impl
\ No newline at end of file
+
+/* The array form, freed with 'delete[]' by default. */
+template <class T, class Deleter> class unique_ptr<T[], Deleter> : private ebo_holder<Deleter>
+{
+  private:
+    T *ptr;
+
+    void clear()
+    {
+        if (ptr != nullptr)
+        {
+            this->held()(ptr);
+            ptr = nullptr;
+        }
+    }
+
+  public:
+    unique_ptr(const unique_ptr &) = delete;
+    unique_ptr &operator=(const unique_ptr &) = delete;
+
+    ~unique_ptr()
+    {
+        clear();
+    }
+
+    explicit unique_ptr(T *p = nullptr, Deleter del = Deleter()) : ebo_holder<Deleter>(std::move(del)), ptr(p)
+    {
+    }
+
+    unique_ptr(unique_ptr &&up) noexcept : ebo_holder<Deleter>(std::move(up.held())), ptr(up.ptr)
+    {
+        up.ptr = nullptr;
+    }
+
+    unique_ptr &operator=(unique_ptr &&up) noexcept
+    {
+        if (this != &up)
+        {
+            clear();
+            ptr = up.ptr, this->held() = std::move(up.held());
+            up.ptr = nullptr;
+        }
+        return *this;
+    }
+
+    T *release() noexcept
+    {
+        return std::exchange(ptr, nullptr);
+    }
+
+    void reset(T *p = nullptr)
+    {
+        T *old = std::exchange(ptr, p);
+        if (old != nullptr)
+            this->held()(old);
+    }
+
+    T *get() const
+    {
+        return ptr;
+    }
+
+    Deleter &get_deleter() noexcept
+    {
+        return this->held();
+    }
+
+    T &operator[](size_t i) const
+    {
+        return ptr[i];
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr != nullptr;
+    }
+};
+
+template <class T, class... Args> std::enable_if_t<!std::is_array_v<T>, unique_ptr<T>> make_unique(Args &&...args)
+{
+    return unique_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+// 'n' value-initialized elements
+template <class T> std::enable_if_t<std::is_array_v<T> && std::extent_v<T> == 0, unique_ptr<T>> make_unique(size_t n)
+{
+    return unique_ptr<T>(new std::remove_extent_t<T>[n]());
+}
+
+/* Destroy and free an object with the allocator it came from. A stateless allocator takes no room, so
+ * unique_ptr<T, allocator_deleter<A>> is one pointer; a stateful one (e.g. a pointer to an arena) is stored.
+ */
+template <class Alloc> class allocator_deleter : private ebo_holder<Alloc>
+{
+    using traits = std::allocator_traits<Alloc>;
+    static_assert(std::is_pointer_v<typename traits::pointer>, "fancy pointers are not supported");
+
+  public:
+    explicit allocator_deleter(const Alloc &alloc = Alloc()) : ebo_holder<Alloc>(alloc)
+    {
+    }
+
+    void operator()(typename traits::pointer p)
+    {
+        traits::destroy(this->held(), p);
+        traits::deallocate(this->held(), p, 1);
+    }
+};
+
+/* The same for arrays, which also needs the number of elements to destroy and free them. */
+template <class Alloc> class allocator_array_deleter : private ebo_holder<Alloc>
+{
+    using traits = std::allocator_traits<Alloc>;
+    static_assert(std::is_pointer_v<typename traits::pointer>, "fancy pointers are not supported");
+
+    size_t n;
+
+  public:
+    explicit allocator_array_deleter(const Alloc &alloc = Alloc(), size_t n = 0) : ebo_holder<Alloc>(alloc), n(n)
+    {
+    }
+
+    void operator()(typename traits::pointer p)
+    {
+        for (size_t i = n; i > 0; --i)
+            traits::destroy(this->held(), p + i - 1);
+        traits::deallocate(this->held(), p, n);
+    }
+
+    size_t size() const noexcept
+    {
+        return n;
+    }
+};
+
+// Allocate a T with 'alloc' (rebound to T), construct it from 'args', and free it back to 'alloc'
+template <class T, class Alloc, class... Args,
+          class A = typename std::allocator_traits<Alloc>::template rebind_alloc<T>>
+std::enable_if_t<!std::is_array_v<T>, unique_ptr<T, allocator_deleter<A>>> allocate_unique(const Alloc &alloc,
+                                                                                          Args &&...args)
+{
+    using traits = std::allocator_traits<A>;
+    A a(alloc);
+    T *p = traits::allocate(a, 1);
+    try
+    {
+        traits::construct(a, p, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        traits::deallocate(a, p, 1);
+        throw;
+    }
+    return unique_ptr<T, allocator_deleter<A>>(p, allocator_deleter<A>(a));
+}
+
+// 'n' value-initialized elements from 'alloc'
+template <class T, class Alloc, class E = std::remove_extent_t<T>,
+          class A = typename std::allocator_traits<Alloc>::template rebind_alloc<E>>
+std::enable_if_t<std::is_array_v<T> && std::extent_v<T> == 0, unique_ptr<T, allocator_array_deleter<A>>>
+allocate_unique(const Alloc &alloc, size_t n)
+{
+    using traits = std::allocator_traits<A>;
+    A a(alloc);
+    E *p = traits::allocate(a, n);
+    size_t i = 0;
+    try
+    {
+        for (; i < n; ++i)
+            traits::construct(a, p + i);
+    }
+    catch (...)
+    {
+        while (i > 0)
+            traits::destroy(a, p + --i);
+        traits::deallocate(a, p, n);
+        throw;
+    }
+    return unique_ptr<T, allocator_array_deleter<A>>(p, allocator_array_deleter<A>(a, n));
+}
+
+static_assert(sizeof(unique_ptr<int>) == sizeof(int *), "a stateless deleter should take no room");
+static_assert(sizeof(unique_ptr<int[]>) == sizeof(int *), "a stateless deleter should take no room");
+static_assert(sizeof(unique_ptr<int, allocator_deleter<std::allocator<int>>>) == sizeof(int *),
+              "a stateless allocator should take no room");
+static_assert(sizeof(unique_ptr<int, void (*)(int *)>) == 2 * sizeof(void *), "a function pointer is stored");
+} // namespace impl
@@ -6,11 +6,13 @@
 #include "unique_ptr.hpp"
 #include <cassert>
 #include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <locale>
 #include <memory>
 #include <stdexcept>
+#include <vector>
 
 // To enable my implementation of unique_ptr or not
 using impl::unique_ptr;
@@ -57,6 +59,29 @@ void close_file(std::FILE *fp)
     std::fclose(fp);
 }
 
+// An allocator which counts what it hands out, it has no state so the deleters take no room
+template <class T> struct counting_allocator
+{
+    using value_type = T;
+    static inline long live = 0;
+
+    counting_allocator() = default;
+    template <class U> counting_allocator(const counting_allocator<U> &)
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        live += n;
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *p, size_t n)
+    {
+        live -= n;
+        std::allocator<T>().deallocate(p, n);
+    }
+};
+
 // unique_ptr-based linked list demo
 struct List
 {
@@ -113,13 +138,16 @@ int main()
 
     std::cout << "\n"
                  "3) Custom deleter demo\n";
-    std::ofstream("demo.txt") << 'x'; // prepare the file to read
+    // prepare the file to read, out of the working tree
+    const auto demo_path = std::filesystem::temp_directory_path() / "unique_ptr_test_demo.txt";
+    std::ofstream(demo_path) << 'x';
     {
         using unique_file_t = unique_ptr<std::FILE, decltype(&close_file)>;
-        unique_file_t fp(std::fopen("demo.txt", "r"), &close_file);
+        unique_file_t fp(std::fopen(demo_path.c_str(), "r"), &close_file);
         if (fp)
             std::cout << char(std::fgetc(fp.get())) << '\n';
     } // `close_file()` called here (if `fp` is not null)
+    std::filesystem::remove(demo_path);
 
     std::cout << "\n"
                  "4) Custom lambda-expression deleter and exception safety demo\n";
@@ -137,15 +165,40 @@ int main()
         std::cout << "Caught exception\n";
     }
 
-    // We do not support the array specification yet
-    // std::cout << "\n"
-    //              "5) Array form of unique_ptr demo\n";
-    // {
-    //     unique_ptr<D[]> p(new D[3]);
-    // } // `D::~D()` is called 3 times
+    std::cout << "\n"
+                 "5) Array form of unique_ptr demo\n";
+    {
+        unique_ptr<D[]> p(new D[3]);
+    } // `D::~D()` is called 3 times
+
+    std::cout << "\n"
+                 "6) make_unique, allocate_unique, release and reset demo\n";
+    {
+        auto buf = impl::make_unique<int[]>(1 << 20); // value-initialized
+        assert(buf[0] == 0 && buf[(1 << 20) - 1] == 0);
+        buf[42] = 42;
+
+        auto q = impl::make_unique<D>();
+        D *raw = q.release(); // `q` does not own it anymore
+        assert(!q);
+        q.reset(raw); // owned again, `D::~D()` is called once at the end of the scope
+
+        // from an allocator, and back to it
+        using alloc_t = counting_allocator<char>;
+        static_assert(sizeof(impl::unique_ptr<D, impl::allocator_deleter<counting_allocator<D>>>) == sizeof(D *));
+        {
+            auto d = impl::allocate_unique<D>(alloc_t());
+            auto arr = impl::allocate_unique<std::vector<int>[]>(alloc_t(), 4);
+            arr[3].push_back(1);
+            assert(counting_allocator<D>::live == 1 && counting_allocator<std::vector<int>>::live == 4);
+            assert(arr.get_deleter().size() == 4);
+        }
+        assert(counting_allocator<D>::live == 0 && counting_allocator<std::vector<int>>::live == 0);
+    }
 
+    // Last, since it needs the en_US.UTF-8 locale and throws where it is missing
     std::cout << "\n"
-                 "6) Linked list demo\n";
+                 "7) Linked list demo\n";
     {
         List wall;
         const int enough{1'000'000};
@@ -0,0 +1,286 @@
+/* C++20 coroutines on top of impl::thread_pool (compile with -std=c++20).
+ * - co_task<T>: a lazy coroutine, it starts when it is awaited, and resumes its awaiter when it finishes.
+ * - co_await pool.schedule(): continue on one of the workers of 'pool'.
+ * - co_await future: wait for a task_future without blocking a thread, the coroutine is resumed on the pool.
+ * - co_spawn(pool, task): start a co_task on the pool, and get a task_future of its result.
+ * - sync_wait(task): run a co_task from a thread outside the pool, and block until it finishes.
+ * A suspended coroutine costs its frame only, thousands of them may wait on a pool of a few threads.
+ *
+ * e.g.
+ *     impl::co_task<int> answer(impl::thread_pool &pool)
+ *     {
+ *         co_await pool.schedule();
+ *         int x = co_await impl::async(pool, []() { return 21; });
+ *         co_return x * 2;
+ *     }
+ */
+#pragma once
+#include "task_future.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace impl
+{
+template <class T = void> class co_task;
+
+/* The part of the promise of co_task<T> which does not depend on T. */
+class co_promise_base
+{
+  public:
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    // Transfer to the awaiter directly (symmetric transfer), so that a long chain of co_tasks finishing one
+    // after another does not grow the stack
+    struct final_awaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+        template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        error = std::current_exception();
+    }
+};
+
+template <class T> class co_promise : public co_promise_base
+{
+  public:
+    std::optional<T> value;
+
+    co_task<T> get_return_object();
+
+    template <class U> void return_value(U &&v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <> class co_promise<void> : public co_promise_base
+{
+  public:
+    co_task<void> get_return_object();
+
+    void return_void()
+    {
+    }
+
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+template <class T> class co_task
+{
+  public:
+    using promise_type = co_promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+  private:
+    handle_type h;
+
+  public:
+    co_task(const co_task &) = delete;
+    co_task &operator=(const co_task &) = delete;
+
+    explicit co_task(handle_type h) : h(h)
+    {
+    }
+
+    co_task(co_task &&t) noexcept : h(std::exchange(t.h, nullptr))
+    {
+    }
+
+    co_task &operator=(co_task &&t) noexcept
+    {
+        if (this != &t)
+        {
+            if (h)
+                h.destroy();
+            h = std::exchange(t.h, nullptr);
+        }
+        return *this;
+    }
+
+    ~co_task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    // Awaiting a co_task starts it, the awaiter is resumed (on the same thread) when it finishes
+    auto operator co_await() && noexcept
+    {
+        struct awaiter
+        {
+            handle_type h;
+
+            bool await_ready() noexcept
+            {
+                return !h || h.done();
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                h.promise().continuation = awaiting;
+                return h;
+            }
+            T await_resume()
+            {
+                return h.promise().result();
+            }
+        };
+        return awaiter{h};
+    }
+};
+
+template <class T> co_task<T> co_promise<T>::get_return_object()
+{
+    return co_task<T>(std::coroutine_handle<co_promise<T>>::from_promise(*this));
+}
+
+inline co_task<void> co_promise<void>::get_return_object()
+{
+    return co_task<void>(std::coroutine_handle<co_promise<void>>::from_promise(*this));
+}
+
+// 'co_await future' resumes the coroutine on the pool of the future (or inline if it has none)
+template <class T> auto operator co_await(task_future<T> future)
+{
+    struct awaiter
+    {
+        task_future<T> future;
+
+        bool await_ready()
+        {
+            return future.ready();
+        }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            // The coroutine may be resumed (and this awaiter destroyed) before on_ready returns, so the state
+            // is kept alive by a local copy
+            auto state = future.shared_state();
+            // A pool which refuses the resumption (full with full_policy::fail, or stopping) would leave the
+            // coroutine suspended for good, it is resumed on the completing thread then
+            state->on_ready([h, pool = state->pool]() {
+                if (pool == nullptr)
+                    return h.resume();
+                try
+                {
+                    pool->post([h]() { h.resume(); });
+                }
+                catch (...)
+                {
+                    h.resume();
+                }
+            });
+        }
+        T await_resume()
+        {
+            if constexpr (std::is_void_v<T>)
+                future.get();
+            else
+                return future.get();
+        }
+    };
+    return awaiter{std::move(future)};
+}
+
+/* A coroutine which starts at once and frees itself when it finishes, for co_spawn and sync_wait. */
+struct detached_coroutine
+{
+    struct promise_type
+    {
+        detached_coroutine get_return_object()
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void()
+        {
+        }
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+// Await 'task' and store its result in 'state', after moving to 'pool' if it is not nullptr
+template <class T>
+detached_coroutine run_detached(thread_pool *pool, co_task<T> task, std::shared_ptr<future_state<T>> state)
+{
+    try
+    {
+        if (pool != nullptr)
+            co_await pool->schedule();
+        if constexpr (std::is_void_v<T>)
+        {
+            co_await std::move(task);
+            state->set_value();
+        }
+        else
+            state->set_value(co_await std::move(task));
+    }
+    catch (...)
+    {
+        state->set_exception(std::current_exception());
+    }
+}
+
+template <class T> task_future<T> co_spawn(thread_pool &pool, co_task<T> task)
+{
+    auto state = std::make_shared<future_state<T>>(&pool);
+    run_detached(&pool, std::move(task), state);
+    return task_future<T>(std::move(state));
+}
+
+// Start 'task' on the calling thread, and block until it finishes (possibly on another thread)
+template <class T> T sync_wait(co_task<T> task)
+{
+    auto state = std::make_shared<future_state<T>>(nullptr);
+    run_detached(nullptr, std::move(task), state);
+    if constexpr (std::is_void_v<T>)
+        task_future<T>(std::move(state)).get();
+    else
+        return task_future<T>(std::move(state)).get();
+}
+} // namespace impl
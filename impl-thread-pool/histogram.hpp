@@ -0,0 +1,104 @@
+/* A lock-free histogram of durations in nanoseconds, with log-linear buckets:
+ * every power of 2 is split into 4 buckets, so a percentile is off by 25% at most.
+ * 'record' is a relaxed fetch_add, histograms are merged on read with 'merge'.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace impl
+{
+class latency_histogram
+{
+  public:
+    static constexpr int sub_bits = 2;
+    static constexpr int nr_buckets = 64 << sub_bits;
+
+    /* A plain copy of a histogram, to be read and merged. */
+    struct snapshot
+    {
+        uint64_t buckets[nr_buckets] = {};
+        uint64_t count = 0, sum = 0, max = 0;
+
+        void merge(const snapshot &s)
+        {
+            for (int i = 0; i < nr_buckets; ++i)
+                buckets[i] += s.buckets[i];
+            count += s.count, sum += s.sum, max = std::max(max, s.max);
+        }
+
+        double mean() const
+        {
+            return count ? (double)sum / count : 0;
+        }
+
+        // The upper bound of the bucket holding the p-th percentile, 0 <= p <= 100
+        uint64_t percentile(double p) const
+        {
+            if (count == 0)
+                return 0;
+            auto rank = (uint64_t)(p / 100 * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (int i = 0; i < nr_buckets; ++i)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return std::min(upper_bound(i), max);
+            }
+            return max;
+        }
+    };
+
+    latency_histogram()
+    {
+        for (auto &b : buckets)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t ns)
+    {
+        buckets[index(ns)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(ns, std::memory_order_relaxed);
+        // only the owner thread records in the per-worker histograms, but keep it correct for shared ones
+        uint64_t cur = max.load(std::memory_order_relaxed);
+        while (ns > cur && !max.compare_exchange_weak(cur, ns, std::memory_order_relaxed))
+            ;
+    }
+
+    snapshot read() const
+    {
+        snapshot s;
+        for (int i = 0; i < nr_buckets; ++i)
+            s.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        s.count = count.load(std::memory_order_relaxed);
+        s.sum = sum.load(std::memory_order_relaxed);
+        s.max = max.load(std::memory_order_relaxed);
+        return s;
+    }
+
+  private:
+    // values below 2^sub_bits get a bucket each, above that 'e' is the position of the highest bit
+    static int index(uint64_t v)
+    {
+        if (v < (1u << sub_bits))
+            return (int)v;
+        int e = 63 - __builtin_clzll(v);
+        int sub = (int)((v >> (e - sub_bits)) & ((1u << sub_bits) - 1));
+        return ((e - sub_bits + 1) << sub_bits) + sub;
+    }
+
+    static uint64_t upper_bound(int i)
+    {
+        if (i < (1 << sub_bits))
+            return i;
+        int e = (i >> sub_bits) + sub_bits - 1;
+        uint64_t sub = i & ((1 << sub_bits) - 1);
+        return (1ull << e) + ((sub + 1) << (e - sub_bits)) - 1;
+    }
+
+    std::atomic<uint64_t> buckets[nr_buckets];
+    std::atomic<uint64_t> count{0}, sum{0}, max{0};
+};
+} // namespace impl
@@ -0,0 +1,133 @@
+/* Bounded lock-free multi-producer/multi-consumer queue, refer to:
+ * 1. https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Every slot carries a sequence number. For the slot at position 'pos':
+ * - seq == pos:     the slot is empty and can be written by the producer who claims 'pos'
+ * - seq == pos + 1: the slot is full and can be read by the consumer who claims 'pos'
+ * After a read the consumer sets seq = pos + capacity, which is the next 'pos' mapped to this slot.
+ */
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace impl
+{
+template <class T> class mpmc_queue
+{
+  private:
+    static constexpr size_t cache_line = 64;
+
+    struct slot
+    {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *value()
+        {
+            return std::launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    size_t mask;
+    std::unique_ptr<slot[]> slots;
+
+    // producers and consumers spin on different cache lines
+    alignas(cache_line) std::atomic<size_t> enqueue_pos;
+    alignas(cache_line) std::atomic<size_t> dequeue_pos;
+
+    static size_t round_up(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+  public:
+    mpmc_queue(const mpmc_queue &) = delete;
+    mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+    // 'capacity' is rounded up to a power of 2
+    explicit mpmc_queue(size_t capacity)
+        : mask(round_up(capacity) - 1), slots(new slot[mask + 1]), enqueue_pos(0), dequeue_pos(0)
+    {
+        for (size_t i = 0; i <= mask; ++i)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~mpmc_queue()
+    {
+        T tmp;
+        while (try_pop(tmp))
+            ;
+    }
+
+    size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    // Return false if the queue is full, 'v' is moved from only on success
+    bool try_push(T &v)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (1)
+        {
+            slot &s = slots[pos & mask];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            auto diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (diff == 0)
+            {
+                // the slot is empty, try to claim 'pos'
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    new (s.storage) T(std::move(v));
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // the slot still holds the value of the previous lap
+            else
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Return false if the queue is empty
+    bool try_pop(T &out)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (1)
+        {
+            slot &s = slots[pos & mask];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            auto diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    out = std::move(*s.value());
+                    s.value()->~T();
+                    s.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // the producer of 'pos' has not finished yet
+            else
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // A hint only, it may be stale as soon as it returns
+    size_t size_approx() const
+    {
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+};
+} // namespace impl
@@ -0,0 +1,169 @@
+/* The future returned by thread_pool::enqueue, in place of std::future.
+ * - The state shared by the task and the future is one std::make_shared, so with a small callable (which
+ *   unique_task stores inline) an enqueue allocates once. std::packaged_task and std::future allocate the state
+ *   and the storage of the result separately in libstdc++.
+ * - pool_future has the members of std::future which the pool's users need: get, wait, wait_for, wait_until and
+ *   valid. Like std::future it is move-only, and 'get' moves the result out and releases the state.
+ * - A task destroyed without being run breaks its promise, as std::packaged_task does: 'get' throws
+ *   std::future_error with std::future_errc::broken_promise.
+ */
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace impl
+{
+template <class T> class result_state
+{
+  public:
+    using value_type = std::conditional_t<std::is_void_v<T>, std::nullptr_t,
+                                          std::conditional_t<std::is_reference_v<T>,
+                                                             std::reference_wrapper<std::remove_reference_t<T>>, T>>;
+
+    // Set the result of 'fn()', or the exception thrown by it
+    template <class F> void fulfill(F &fn)
+    {
+        try
+        {
+            if constexpr (std::is_void_v<T>)
+                fn(), finish(nullptr, nullptr);
+            else if constexpr (std::is_reference_v<T>)
+                finish(std::ref(static_cast<T>(fn())), nullptr);
+            else
+                finish(fn(), nullptr);
+        }
+        catch (...)
+        {
+            finish(std::nullopt, std::current_exception());
+        }
+    }
+
+    void abandon()
+    {
+        finish(std::nullopt, std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    }
+
+    void wait()
+    {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [this]() { return ready; });
+    }
+
+    template <class Clock, class Duration> bool wait_until(const std::chrono::time_point<Clock, Duration> &t)
+    {
+        std::unique_lock lock(mtx);
+        return cv.wait_until(lock, t, [this]() { return ready; });
+    }
+
+    // After 'wait', rethrow the exception of the task or move its result out
+    T take()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        if constexpr (std::is_reference_v<T>)
+            return static_cast<T>(value->get());
+        else if constexpr (!std::is_void_v<T>)
+            return std::move(*value);
+    }
+
+  private:
+    template <class V> void finish(V &&v, std::exception_ptr e)
+    {
+        {
+            std::unique_lock lock(mtx);
+            if constexpr (!std::is_same_v<std::decay_t<V>, std::nullopt_t>)
+                value.emplace(std::forward<V>(v));
+            error = e;
+            ready = true;
+        }
+        // the task keeps the state alive until it returns, so the future may be gone already
+        cv.notify_all();
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool ready = false;
+    std::optional<value_type> value;
+    std::exception_ptr error;
+};
+
+template <class T> class pool_future
+{
+  public:
+    pool_future() = default;
+    explicit pool_future(std::shared_ptr<result_state<T>> state) : state(std::move(state))
+    {
+    }
+
+    bool valid() const noexcept
+    {
+        return state != nullptr;
+    }
+
+    void wait() const
+    {
+        state->wait();
+    }
+
+    template <class Rep, class Period> std::future_status wait_for(const std::chrono::duration<Rep, Period> &d) const
+    {
+        return wait_until(std::chrono::steady_clock::now() + d);
+    }
+
+    template <class Clock, class Duration>
+    std::future_status wait_until(const std::chrono::time_point<Clock, Duration> &t) const
+    {
+        return state->wait_until(t) ? std::future_status::ready : std::future_status::timeout;
+    }
+
+    // Block until the task has run, then return its result or rethrow its exception. The future is invalid
+    // afterwards, as a std::future is.
+    T get()
+    {
+        auto s = std::move(state);
+        s->wait();
+        return s->take();
+    }
+
+  private:
+    std::shared_ptr<result_state<T>> state;
+};
+
+/* The task queued by thread_pool::enqueue: it runs 'fn' into the state, or breaks the promise if it is destroyed
+ * without having run. Nothrow movable when 'F' is, so that unique_task can keep it inline.
+ */
+template <class T, class F> class result_task
+{
+  public:
+    result_task(std::shared_ptr<result_state<T>> state, F &&fn) : state(std::move(state)), fn(std::move(fn))
+    {
+    }
+
+    result_task(result_task &&) = default;
+    result_task &operator=(result_task &&) = delete;
+
+    ~result_task()
+    {
+        if (state)
+            state->abandon();
+    }
+
+    void operator()()
+    {
+        auto s = std::move(state);
+        s->fulfill(fn);
+    }
+
+  private:
+    std::shared_ptr<result_state<T>> state;
+    F fn;
+};
+} // namespace impl
@@ -0,0 +1,163 @@
+/* The queues of thread_pool for tasks submitted with a priority class or a deadline.
+ * - high: served first, earliest deadline first. A plain high task uses its enqueue time as the deadline,
+ *   so high tasks without a deadline are FIFO among themselves.
+ * - normal: served after high, before the untagged tasks of the pool (which are normal too).
+ * - background: served when nothing else is queued.
+ * Starvation protection:
+ * - if no background task has been served for 'starvation_limit', and the oldest one has waited that long,
+ *   it goes before everything else (so a starved background class gets one task per 'starvation_limit');
+ * - after 'high_burst' high tasks in a row, one normal task (tagged or not) is served if any is waiting.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "histogram.hpp"
+#include "unique_task.hpp"
+
+namespace impl
+{
+enum class task_priority
+{
+    high,
+    normal,
+    background
+};
+
+class priority_scheduler
+{
+  public:
+    using clock = std::chrono::steady_clock;
+    using clock_fn = clock::time_point (*)();
+
+    // 'read_clock' is for the tests, to drive the starvation protection without waiting
+    priority_scheduler(clock::duration starvation_limit, unsigned high_burst, clock_fn read_clock = clock::now)
+        : starvation_limit(starvation_limit), high_burst(high_burst), read_clock(read_clock), high_streak(0), seq(0),
+          last_background(read_clock()), count(0)
+    {
+    }
+
+    // 'deadline' orders the high class only
+    void push(task_priority prio, clock::time_point deadline, unique_task task)
+    {
+        auto now = read_clock();
+        std::unique_lock lock(mtx);
+        entry e = {deadline, now, seq++, prio, std::move(task)};
+        if (prio == task_priority::high)
+        {
+            high.emplace_back(std::move(e));
+            std::push_heap(high.begin(), high.end(), later);
+        }
+        else if (prio == task_priority::normal)
+            normal.emplace_back(std::move(e));
+        else
+            background.emplace_back(std::move(e));
+        count.fetch_add(1);
+    }
+
+    // A task which goes before the untagged tasks of the pool, 'others_waiting' tells whether there are any
+    bool pop_before_normal(unique_task &task, bool others_waiting)
+    {
+        if (empty())
+            return false;
+
+        std::unique_lock lock(mtx);
+        auto now = read_clock();
+        if (!background.empty() && now - background.front().enqueued >= starvation_limit &&
+            now - last_background >= starvation_limit)
+        {
+            return take(background, task, now);
+        }
+
+        if (!high.empty())
+        {
+            bool skip = high_streak >= high_burst && (!normal.empty() || others_waiting);
+            if (!skip)
+            {
+                high_streak++;
+                std::pop_heap(high.begin(), high.end(), later);
+                finish(high.back(), task, now);
+                high.pop_back();
+                return true;
+            }
+        }
+
+        high_streak = 0;
+        return !normal.empty() && take(normal, task, now);
+    }
+
+    bool pop_background(unique_task &task)
+    {
+        if (empty())
+            return false;
+
+        std::unique_lock lock(mtx);
+        return !background.empty() && take(background, task, read_clock());
+    }
+
+    bool empty() const
+    {
+        return count.load() == 0;
+    }
+
+    size_t size() const
+    {
+        return count.load();
+    }
+
+    // How long the tasks of one class have waited in the queue, in nanoseconds
+    latency_histogram::snapshot queue_latency(task_priority prio) const
+    {
+        return latency[(int)prio].read();
+    }
+
+  private:
+    struct entry
+    {
+        clock::time_point deadline, enqueued;
+        uint64_t seq;
+        task_priority prio;
+        unique_task task;
+    };
+
+    // std::push_heap builds a max-heap, so the earliest deadline must compare the greatest
+    static bool later(const entry &a, const entry &b)
+    {
+        return a.deadline != b.deadline ? a.deadline > b.deadline : a.seq > b.seq;
+    }
+
+    void finish(entry &e, unique_task &task, clock::time_point now)
+    {
+        if (e.prio == task_priority::background)
+            last_background = now;
+        task = std::move(e.task);
+        latency[(int)e.prio].record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - e.enqueued).count());
+        count.fetch_sub(1);
+    }
+
+    bool take(std::deque<entry> &q, unique_task &task, clock::time_point now)
+    {
+        finish(q.front(), task, now);
+        q.pop_front();
+        return true;
+    }
+
+    const clock::duration starvation_limit;
+    const unsigned high_burst;
+    const clock_fn read_clock;
+
+    std::mutex mtx;
+    std::vector<entry> high; // a heap ordered by 'later'
+    std::deque<entry> normal, background;
+    unsigned high_streak; // high tasks served in a row
+    uint64_t seq;         // FIFO order among equal deadlines
+    clock::time_point last_background;
+
+    std::atomic<size_t> count;
+    latency_histogram latency[3];
+};
+} // namespace impl
@@ -0,0 +1,290 @@
+/* Non-blocking continuations on top of impl::thread_pool.
+ * - impl::async(pool, f, args...) runs 'f(args...)' on the pool and returns a task_future.
+ * - task_future::then(g) runs 'g(value)' on the pool once the value is ready, and returns another task_future.
+ * - impl::when_all / impl::when_any combine several futures without occupying any thread while waiting.
+ * Only 'get' and 'wait' block, they are meant for threads outside the pool.
+ */
+#pragma once
+#include "thread_pool.hpp"
+
+#include <exception>
+#include <type_traits>
+
+namespace impl
+{
+template <class T> class task_future;
+
+/* The state shared by a task_future and the code which produces its value. It is allocated once with
+ * std::make_shared, callbacks registered before the value is ready are stored here, and run by the thread
+ * which sets the value, callbacks registered afterwards are run at once.
+ */
+template <class T> class future_state
+{
+  public:
+    using value_type = std::conditional_t<std::is_void_v<T>, std::nullptr_t, T>;
+
+    explicit future_state(thread_pool *pool) : pool(pool), ready(false)
+    {
+    }
+
+    template <class... V> void set_value(V &&...v)
+    {
+        store(std::forward<V>(v)...);
+        finish();
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        {
+            std::unique_lock lock(mtx);
+            error = e;
+        }
+        finish();
+    }
+
+    // Set the value with the result of 'fn()', or the exception thrown by it. The callbacks run outside the
+    // 'try', so that what they throw cannot turn a value into an error.
+    template <class F> void fulfill(F &&fn)
+    {
+        try
+        {
+            if constexpr (std::is_void_v<T>)
+                fn(), store();
+            else
+                store(fn());
+        }
+        catch (...)
+        {
+            return set_exception(std::current_exception());
+        }
+        finish();
+    }
+
+    // Callbacks run on the thread completing the state, they should be short (usually they post to the pool)
+    void on_ready(unique_task callback)
+    {
+        {
+            std::unique_lock lock(mtx);
+            if (!ready)
+            {
+                callbacks.emplace_back(std::move(callback));
+                return;
+            }
+        }
+        callback();
+    }
+
+    void wait()
+    {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [this]() { return ready; });
+    }
+
+    bool is_ready()
+    {
+        std::unique_lock lock(mtx);
+        return ready;
+    }
+
+    thread_pool *const pool; // where continuations run, nullptr to run them inline
+    std::optional<value_type> value;
+    std::exception_ptr error;
+
+  private:
+    template <class... V> void store(V &&...v)
+    {
+        std::unique_lock lock(mtx);
+        value.emplace(std::forward<V>(v)...);
+    }
+
+    void finish()
+    {
+        std::vector<unique_task> todo;
+        {
+            std::unique_lock lock(mtx);
+            ready = true;
+            todo.swap(callbacks);
+        }
+        cv.notify_all();
+        for (auto &callback : todo)
+            callback();
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool ready;
+    std::vector<unique_task> callbacks;
+};
+
+// The return type of 'fn(value)', or 'fn()' for a task_future<void>
+template <class F, class T> struct then_result
+{
+    using type = std::invoke_result_t<F &, const T &>;
+};
+template <class F> struct then_result<F, void>
+{
+    using type = std::invoke_result_t<F &>;
+};
+
+/* Like std::shared_future, a task_future can be copied, and every copy refers to the same value. */
+template <class T> class task_future
+{
+  private:
+    std::shared_ptr<future_state<T>> state;
+
+  public:
+    task_future() = default;
+    explicit task_future(std::shared_ptr<future_state<T>> state) : state(std::move(state))
+    {
+    }
+
+    bool valid() const
+    {
+        return state != nullptr;
+    }
+
+    bool ready() const
+    {
+        return state->is_ready();
+    }
+
+    void wait() const
+    {
+        state->wait();
+    }
+
+    // Block until the value is ready, rethrow if the task has thrown
+    decltype(auto) get() const
+    {
+        state->wait();
+        if (state->error)
+            std::rethrow_exception(state->error);
+        if constexpr (!std::is_void_v<T>)
+            return static_cast<const T &>(*state->value);
+    }
+
+    // Run 'fn(value)' ('fn()' for task_future<void>) on the pool once this future is ready, without blocking
+    // any thread in between. If this future holds an exception, 'fn' is skipped and the exception is passed on.
+    // If the pool refuses the continuation (its queue is full with full_policy::fail, or it is stopping), the
+    // returned future holds the exception thrown by the pool.
+    template <class F> auto then(F &&fn) const
+    {
+        using result_type = typename then_result<F, T>::type;
+
+        auto prev = state;
+        auto next = std::make_shared<future_state<result_type>>(prev->pool);
+        auto run = [prev, next, fn = std::forward<F>(fn)]() mutable {
+            if (prev->error)
+                return next->set_exception(prev->error);
+            next->fulfill([&]() -> result_type {
+                if constexpr (std::is_void_v<T>)
+                    return fn();
+                else
+                    return fn(static_cast<const T &>(*prev->value));
+            });
+        };
+
+        prev->on_ready([pool = prev->pool, next, run = std::move(run)]() mutable {
+            if (pool == nullptr)
+                return run();
+            try
+            {
+                pool->post(std::move(run));
+            }
+            catch (...)
+            {
+                next->set_exception(std::current_exception());
+            }
+        });
+        return task_future<result_type>(std::move(next));
+    }
+
+    // Register a callback on the completing thread, for the combinators below
+    void on_ready(unique_task callback) const
+    {
+        state->on_ready(std::move(callback));
+    }
+
+    const std::shared_ptr<future_state<T>> &shared_state() const
+    {
+        return state;
+    }
+};
+
+// Run 'f(args...)' on 'pool', one allocation for the shared state (and none for the task if 'f' is small)
+template <class F, class... Args> auto async(thread_pool &pool, F &&f, Args &&...args)
+{
+    using result_type = task_result_t<F, Args...>;
+    auto state = std::make_shared<future_state<result_type>>(&pool);
+    pool.post(
+        [state, f = std::forward<F>(f)](auto &...args) mutable { state->fulfill([&]() { return f(args...); }); },
+        std::forward<Args>(args)...);
+    return task_future<result_type>(std::move(state));
+}
+
+// Ready once all 'futures' are ready. The values are gathered in order, the first exception (by position) wins.
+template <class T> auto when_all(std::vector<task_future<T>> futures)
+{
+    using result_type = std::conditional_t<std::is_void_v<T>, void, std::vector<T>>;
+    thread_pool *pool = futures.empty() ? nullptr : futures[0].shared_state()->pool;
+    auto all = std::make_shared<future_state<result_type>>(pool);
+
+    struct context
+    {
+        std::atomic<size_t> left;
+        std::vector<task_future<T>> inputs;
+    };
+    auto ctx = std::make_shared<context>();
+    ctx->left = futures.size();
+    ctx->inputs = std::move(futures);
+
+    auto gather = [](context &ctx, future_state<result_type> &all) {
+        for (auto &f : ctx.inputs)
+        {
+            if (f.shared_state()->error)
+                return all.set_exception(f.shared_state()->error);
+        }
+        if constexpr (std::is_void_v<T>)
+            all.set_value();
+        else
+        {
+            std::vector<T> values;
+            values.reserve(ctx.inputs.size());
+            for (auto &f : ctx.inputs)
+                values.emplace_back(*f.shared_state()->value);
+            all.set_value(std::move(values));
+        }
+    };
+
+    if (ctx->inputs.empty())
+        gather(*ctx, *all);
+    for (auto &f : ctx->inputs)
+    {
+        // the last one to finish gathers, 'ctx' is released as soon as all callbacks have run
+        f.on_ready([ctx, all, gather]() {
+            if (ctx->left.fetch_sub(1) == 1)
+                gather(*ctx, *all);
+        });
+    }
+    return task_future<result_type>(std::move(all));
+}
+
+// Ready once any of 'futures' is ready, with the index of the first one to finish. The value (or exception)
+// is then read from futures[index] without blocking.
+template <class T> task_future<size_t> when_any(const std::vector<task_future<T>> &futures)
+{
+    if (futures.empty())
+        throw std::invalid_argument("when_any needs at least one future.");
+
+    auto any = std::make_shared<future_state<size_t>>(futures[0].shared_state()->pool);
+    auto won = std::make_shared<std::atomic<bool>>(false);
+    for (size_t i = 0; i < futures.size(); ++i)
+    {
+        futures[i].on_ready([any, won, i]() {
+            if (!won->exchange(true))
+                any->set_value(i);
+        });
+    }
+    return task_future<size_t>(std::move(any));
+}
+} // namespace impl
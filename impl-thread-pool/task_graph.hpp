@@ -0,0 +1,169 @@
+/* A small dependency graph of tasks on top of impl::thread_pool.
+ * A node is posted to the pool once all of its predecessors have finished, so no worker ever waits for
+ * another task. The run itself is a task_future<void>, ready when every node has finished.
+ *
+ * e.g.
+ *     impl::task_graph g;
+ *     auto a = g.emplace(load), b = g.emplace(parse), c = g.emplace(index), d = g.emplace(store);
+ *     g.precede(a, b), g.precede(b, c), g.precede(b, d);
+ *     g.run(pool).get();
+ */
+#pragma once
+#include "task_future.hpp"
+
+#include <stdexcept>
+
+namespace impl
+{
+class task_graph
+{
+  public:
+    using node = size_t;
+
+    // Add a node running 'fn()', the graph can be run many times so 'fn' is kept (and must be copyable)
+    template <class F> node emplace(F &&fn)
+    {
+        nodes.push_back({std::function<void()>(std::forward<F>(fn)), {}, 0});
+        return nodes.size() - 1;
+    }
+
+    // 'after' starts only once 'before' has finished
+    void precede(node before, node after)
+    {
+        if (before >= nodes.size() || after >= nodes.size() || before == after)
+            throw std::invalid_argument("Invalid edge of task_graph.");
+        nodes[before].successors.push_back(after);
+        nodes[after].nr_preds++;
+    }
+
+    size_t size() const
+    {
+        return nodes.size();
+    }
+
+    // Schedule the nodes without predecessors, and return at once. The graph must not be changed or destroyed
+    // before the returned future is ready. If a node throws, the nodes which have not started yet are skipped,
+    // and the first exception is stored in the returned future.
+    task_future<void> run(thread_pool &pool)
+    {
+        check_acyclic();
+
+        auto done = std::make_shared<future_state<void>>(&pool);
+        if (nodes.empty())
+        {
+            done->set_value();
+            return task_future<void>(done);
+        }
+
+        auto r = std::make_shared<run_state>(*this, pool, done);
+        for (node i = 0; i < nodes.size(); ++i)
+        {
+            if (nodes[i].nr_preds == 0)
+                pool.post([r, i]() { r->execute(i); });
+        }
+        return task_future<void>(done);
+    }
+
+  private:
+    struct node_data
+    {
+        std::function<void()> work;
+        std::vector<node> successors;
+        size_t nr_preds;
+    };
+
+    /* The counters of one run, so that a graph can be run again (or concurrently). */
+    struct run_state : std::enable_shared_from_this<run_state>
+    {
+        const task_graph &graph;
+        thread_pool &pool;
+        std::shared_ptr<future_state<void>> done;
+        std::unique_ptr<std::atomic<size_t>[]> preds; // predecessors not finished yet, per node
+        std::atomic<size_t> left;                      // nodes not finished yet
+        std::atomic<bool> failed;
+        std::mutex mtx;
+        std::exception_ptr error;
+
+        run_state(const task_graph &graph, thread_pool &pool, std::shared_ptr<future_state<void>> done)
+            : graph(graph), pool(pool), done(std::move(done)), preds(new std::atomic<size_t>[graph.size()]),
+              left(graph.size()), failed(false)
+        {
+            for (node i = 0; i < graph.size(); ++i)
+                preds[i] = graph.nodes[i].nr_preds;
+        }
+
+        void execute(node i)
+        {
+            // One ready successor is run by this thread directly, the others are posted
+            while (1)
+            {
+                if (!failed.load(std::memory_order_relaxed))
+                {
+                    try
+                    {
+                        graph.nodes[i].work();
+                    }
+                    catch (...)
+                    {
+                        std::unique_lock lock(mtx);
+                        if (!error)
+                            error = std::current_exception();
+                        failed = true;
+                    }
+                }
+
+                node next = graph.size();
+                for (node succ : graph.nodes[i].successors)
+                {
+                    if (preds[succ].fetch_sub(1) != 1)
+                        continue;
+                    if (next != graph.size())
+                        pool.post([self = this->shared_from_this(), next]() { self->execute(next); });
+                    next = succ;
+                }
+
+                if (left.fetch_sub(1) == 1)
+                {
+                    if (error)
+                        done->set_exception(error);
+                    else
+                        done->set_value();
+                }
+
+                if (next == graph.size())
+                    return;
+                i = next;
+            }
+        }
+    };
+
+    // Kahn's algorithm, a cycle would leave some nodes waiting forever
+    void check_acyclic() const
+    {
+        std::vector<size_t> preds(nodes.size());
+        std::vector<node> ready;
+        for (node i = 0; i < nodes.size(); ++i)
+        {
+            preds[i] = nodes[i].nr_preds;
+            if (preds[i] == 0)
+                ready.push_back(i);
+        }
+
+        size_t visited = 0;
+        while (!ready.empty())
+        {
+            node i = ready.back();
+            ready.pop_back(), visited++;
+            for (node succ : nodes[i].successors)
+            {
+                if (--preds[succ] == 0)
+                    ready.push_back(succ);
+            }
+        }
+        if (visited != nodes.size())
+            throw std::invalid_argument("task_graph has a cycle.");
+    }
+
+    std::vector<node_data> nodes;
+};
+} // namespace impl
@@ -0,0 +1,123 @@
+// g++ -std=c++20 -pthread test_coroutine.cpp
+#include "coroutine.hpp"
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// hop onto the pool, then await a result produced by the pool
+impl::co_task<int> add_on_pool(impl::thread_pool &pool, int a, int b)
+{
+    co_await pool.schedule();
+    int x = co_await impl::async(pool, [a]() { return a * 10; });
+    co_return x + b;
+}
+
+impl::co_task<std::string> chain(impl::thread_pool &pool)
+{
+    // awaiting co_tasks, nested
+    int x = co_await add_on_pool(pool, 4, 2);
+    co_return std::to_string(x);
+}
+
+impl::co_task<void> throwing(impl::thread_pool &pool)
+{
+    co_await pool.schedule();
+    throw std::runtime_error("from a coroutine");
+}
+
+void test_basic()
+{
+    impl::thread_pool pool(2);
+    assert(impl::sync_wait(chain(pool)) == "42");
+
+    auto f = impl::co_spawn(pool, add_on_pool(pool, 1, 1)).then([](int x) { return x * 2; });
+    assert(f.get() == 22);
+
+    bool thrown = false;
+    try
+    {
+        impl::sync_wait(throwing(pool));
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+impl::co_task<void> waiter(impl::thread_pool &pool, impl::task_future<int> gate, std::atomic<int> &sum)
+{
+    co_await pool.schedule();
+    sum.fetch_add(co_await gate);
+}
+
+// many coroutines suspended on one future, on a pool of 2 threads
+void test_many_suspended()
+{
+    constexpr int N = 10000;
+    impl::thread_pool pool(2);
+
+    auto state = std::make_shared<impl::future_state<int>>(&pool);
+    impl::task_future<int> gate(state);
+    std::atomic<int> sum(0);
+
+    std::vector<impl::task_future<void>> done;
+    for (int i = 0; i < N; ++i)
+        done.emplace_back(impl::co_spawn(pool, waiter(pool, gate, sum)));
+
+    // nothing can finish before the gate opens, and no thread is blocked meanwhile
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(sum.load() == 0);
+    auto ok = impl::async(pool, []() { return 1; });
+    assert(ok.get() == 1);
+
+    state->set_value(1);
+    impl::when_all(done).get();
+    assert(sum.load() == N);
+    std::printf("%d coroutines resumed on %zu threads\n", N, pool.size());
+}
+
+impl::co_task<int> await_gate(impl::task_future<int> gate, std::atomic<bool> &suspending)
+{
+    suspending = true;
+    co_return co_await gate;
+}
+
+// a pool which refuses the resumption (full, with full_policy::fail) does not strand the coroutine
+void test_refused_resume()
+{
+    impl::pool_options opts;
+    opts.queue_capacity = 4;
+    opts.on_full = impl::full_policy::fail;
+    impl::thread_pool pool(1, opts);
+
+    auto state = std::make_shared<impl::future_state<int>>(&pool);
+    std::atomic<bool> suspending(false);
+    int got = 0;
+    std::thread waiting([&]() { got = impl::sync_wait(await_gate(impl::task_future<int>(state), suspending)); });
+    while (!suspending)
+        std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    std::promise<void> hold, started;
+    std::shared_future<void> released = hold.get_future().share();
+    pool.post([released, &started]() {
+        started.set_value();
+        released.wait();
+    });
+    started.get_future().wait();
+    while (pool.try_enqueue([]() {}).has_value())
+        ;
+    state->set_value(5);
+    waiting.join();
+    assert(got == 5);
+    hold.set_value();
+}
+
+int main()
+{
+    test_basic();
+    test_many_suspended();
+    test_refused_resume();
+}
@@ -1,10 +1,38 @@
 #include "thread_pool.hpp"
+#include "task_graph.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+// Count the heap allocations made by the current thread. The operators are kept out of line, otherwise
+// gcc sees a 'new' paired with a 'free' and warns about it.
+static thread_local size_t nr_allocs = 0;
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    ++nr_allocs;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
 
 // tasks with returned value, no arguments
 void simple_test()
 {
     impl::thread_pool pool(16);
-    std::vector<std::future<int>> res;
+    std::vector<impl::pool_future<int>> res;
 
     for (int i = 0; i < 100; ++i)
     {
@@ -34,7 +62,7 @@ void test_sorting()
 
     constexpr size_t nr_threads = 32;
     impl::thread_pool pool(nr_threads);
-    std::vector<std::future<std::pair<int, int>>> res;
+    std::vector<impl::pool_future<std::pair<int, int>>> res;
 
     auto sorting_task = [](std::vector<int> &nums, int l, int r) {
         std::sort(nums.begin() + l, nums.begin() + r);
@@ -59,8 +87,826 @@ void test_sorting()
     }
 }
 
+// tasks enqueued from inside the workers, the recursive pattern that work stealing is built for
+void test_work_stealing()
+{
+    impl::thread_pool pool(8, impl::schedule_policy::work_stealing);
+    std::atomic<int> counter(0);
+
+    std::function<void(int)> spawn = [&](int depth) {
+        counter.fetch_add(1);
+        if (depth == 0)
+            return;
+        pool.enqueue(spawn, depth - 1);
+        pool.enqueue(spawn, depth - 1);
+    };
+    constexpr int depth = 12;
+    pool.enqueue(spawn, depth).get();
+
+    // (2 ^ (depth + 1) - 1) tasks in the full binary tree
+    while (counter.load() != (1 << (depth + 1)) - 1)
+        std::this_thread::yield();
+
+    auto future = pool.enqueue([](int a, int b) { return a + b; }, 1, 2);
+    assert(future.get() == 3);
+}
+
+// the bounded lock-free submission queue, and what happens when it is full
+void test_bounded_queue()
+{
+    impl::pool_options opts;
+    opts.queue_capacity = 4;
+    opts.on_full = impl::full_policy::fail;
+    impl::thread_pool pool(1, opts);
+
+    // hold the only worker, so that nothing is popped from the queue
+    std::promise<void> gate, started;
+    std::shared_future<void> opened = gate.get_future().share();
+    auto blocker = pool.enqueue([opened, &started]() {
+        started.set_value();
+        opened.wait();
+    });
+    started.get_future().wait();
+    while (pool.try_enqueue([]() {}).has_value())
+        ;
+
+    bool thrown = false;
+    try
+    {
+        pool.enqueue([]() {});
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    gate.set_value();
+    blocker.get();
+
+    // full_policy::block, many producers against a tiny queue
+    opts.on_full = impl::full_policy::block;
+    for (auto policy : {impl::schedule_policy::shared_queue, impl::schedule_policy::work_stealing})
+    {
+        opts.policy = policy;
+        impl::thread_pool blocking_pool(4, opts);
+        std::atomic<int> sum(0);
+        std::vector<std::thread> producers;
+        for (int p = 0; p < 4; ++p)
+        {
+            producers.emplace_back([&]() {
+                for (int i = 1; i <= 1000; ++i)
+                    blocking_pool.enqueue([&sum, i]() { sum.fetch_add(i); });
+            });
+        }
+        for (auto &t : producers)
+            t.join();
+        blocking_pool.enqueue([]() {}).get();
+        while (sum.load() != 4 * 500500)
+            std::this_thread::yield();
+    }
+}
+
+// heap allocations per submitted task, counted in the submitting thread
+void test_task_allocations()
+{
+    constexpr int N = 1000;
+    impl::pool_options opts;
+    opts.queue_capacity = 2 * N;
+    impl::thread_pool pool(2, opts);
+
+    std::atomic<int> done(0);
+    size_t before = nr_allocs;
+    for (int i = 0; i < N; ++i)
+        pool.post([&done, i]() { done.fetch_add(i > -1); });
+    size_t post_allocs = nr_allocs - before;
+
+    std::vector<impl::pool_future<int>> res;
+    res.reserve(N);
+    before = nr_allocs;
+    for (int i = 0; i < N; ++i)
+        res.emplace_back(pool.enqueue([i]() { return i; }));
+    size_t enqueue_allocs = nr_allocs - before;
+
+    for (int i = 0; i < N; ++i)
+        assert(res[i].get() == i);
+    while (done.load() != N)
+        std::this_thread::yield();
+
+    // post: zero. enqueue: the shared state of the pool_future only, one make_shared.
+    std::printf("allocations per task: post = %.2f, enqueue = %.2f\n", (double)post_allocs / N,
+                (double)enqueue_allocs / N);
+    assert(post_allocs == 0);
+    assert(enqueue_allocs <= N);
+
+    // move-only results and arguments work, which std::function could not hold
+    auto moved = pool.enqueue([](std::unique_ptr<int> &p) { return *p; }, std::make_unique<int>(7));
+    assert(moved.get() == 7);
+
+    // pool_future behaves as std::future: move-only results, references, exceptions, and get() releases it
+    auto owned = pool.enqueue([]() { return std::make_unique<int>(8); });
+    assert(owned.wait_for(std::chrono::seconds(5)) == std::future_status::ready && *owned.get() == 8);
+    assert(!owned.valid());
+    int target = 0;
+    auto ref = pool.enqueue([&target]() -> int & { return target; });
+    assert(&ref.get() == &target);
+    bool thrown = false;
+    try
+    {
+        pool.enqueue([]() -> int { throw std::out_of_range("enqueue"); }).get();
+    }
+    catch (const std::out_of_range &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // a task dropped without running breaks its promise
+    auto state = std::make_shared<impl::result_state<int>>();
+    impl::pool_future<int> broken(state);
+    {
+        auto fn = []() { return 1; };
+        impl::unique_task dropped(impl::result_task<int, decltype(fn)>(std::move(state), std::move(fn)));
+    }
+    try
+    {
+        broken.get();
+        assert(false);
+    }
+    catch (const std::future_error &e)
+    {
+        assert(e.code() == std::future_errc::broken_promise);
+    }
+}
+
+// bulk loops over a range, with the calling thread joining in
+void test_parallel_for()
+{
+    for (auto policy : {impl::schedule_policy::shared_queue, impl::schedule_policy::work_stealing})
+    {
+        impl::thread_pool pool(8, policy);
+
+        constexpr int N = 1e6 + 7;
+        std::vector<int> nums(N);
+        pool.parallel_for(0, N, 1024, [&](int i) { nums[i] = i % 100; });
+        for (int i = 0; i < N; ++i)
+            assert(nums[i] == i % 100);
+
+        // chunk form
+        pool.parallel_for(0, N, 4096, [&](int lo, int hi) { std::sort(nums.begin() + lo, nums.begin() + hi); });
+
+        long long expected = 0;
+        for (int x : nums)
+            expected += x;
+        auto sum = pool.parallel_reduce(0, N, 1024, 0LL, [&](int i) { return (long long)nums[i]; },
+                                        [](long long a, long long b) { return a + b; });
+        assert(sum == expected);
+
+        auto chunk_max = [&](size_t lo, size_t hi) { return *std::max_element(&nums[lo], &nums[hi]); };
+        auto max_val = pool.parallel_reduce(size_t(0), nums.size(), size_t(1), -1, chunk_max,
+                                            [](int a, int b) { return std::max(a, b); });
+        assert(max_val == 99);
+
+        // empty range, and nested calls from inside a worker
+        assert(pool.parallel_reduce(5, 5, 1, 42, [](int i) { return i; }, std::plus<int>()) == 42);
+        auto nested = pool.enqueue([&]() {
+            return pool.parallel_reduce(0, 1000, 10, 0, [](int i) { return i; }, std::plus<int>());
+        });
+        assert(nested.get() == 499500);
+
+        // the first exception is rethrown in the caller
+        bool thrown = false;
+        try
+        {
+            pool.parallel_for(0, 100000, 16, [](int i) {
+                if (i == 31337)
+                    throw std::out_of_range("31337");
+            });
+        }
+        catch (const std::out_of_range &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+// continuations on a pool of one worker, which would deadlock if any stage blocked on its input
+void test_continuations()
+{
+    impl::thread_pool pool(1);
+
+    auto f = impl::async(pool, [](int x) { return x * 2; }, 21)
+                 .then([](int x) { return std::to_string(x); })
+                 .then([](const std::string &s) { return s + "!"; });
+    assert(f.get() == "42!");
+
+    // exceptions skip the following stages
+    bool skipped = true;
+    auto g = impl::async(pool, []() -> int { throw std::logic_error("oops"); }).then([&](int) {
+        skipped = false;
+        return 0;
+    });
+    bool thrown = false;
+    try
+    {
+        g.get();
+    }
+    catch (const std::logic_error &)
+    {
+        thrown = true;
+    }
+    assert(thrown && skipped);
+
+    // when_all keeps the order of its inputs
+    std::vector<impl::task_future<int>> parts;
+    for (int i = 0; i < 100; ++i)
+        parts.emplace_back(impl::async(pool, [i]() { return i * i; }));
+    auto total = impl::when_all(parts).then([](const std::vector<int> &v) {
+        int sum = 0;
+        for (size_t i = 0; i < v.size(); ++i)
+            sum += (v[i] == int(i * i)) ? v[i] : -1;
+        return sum;
+    });
+    assert(total.get() == 328350);
+
+    // when_any, the slow one is still blocked by the gate when the fast one finishes
+    std::promise<void> gate;
+    std::shared_future<void> opened = gate.get_future().share();
+    impl::thread_pool pool2(2);
+    std::vector<impl::task_future<int>> racers = {impl::async(pool2, [opened]() { return opened.wait(), 1; }),
+                                                  impl::async(pool2, []() { return 2; })};
+    auto first = impl::when_any(racers);
+    assert(first.get() == 1 && racers[1].get() == 2);
+    gate.set_value();
+    impl::when_all(racers).get();
+
+    // a continuation refused by a full queue fails its own future, the others still get theirs
+    impl::pool_options opts;
+    opts.queue_capacity = 4;
+    opts.on_full = impl::full_policy::fail;
+    impl::thread_pool bounded(1, opts);
+    std::promise<void> hold, started;
+    std::shared_future<void> released = hold.get_future().share();
+    auto head = impl::async(bounded, [released, &started]() {
+        started.set_value();
+        released.wait();
+        return 7;
+    });
+    std::vector<impl::task_future<int>> tails;
+    for (int i = 0; i < 3; ++i)
+        tails.emplace_back(head.then([i](int x) { return x + i; }));
+    started.get_future().wait();
+    while (bounded.try_enqueue([]() {}).has_value())
+        ;
+    hold.set_value();
+    assert(head.get() == 7);
+    for (auto &tail : tails)
+    {
+        bool refused = false;
+        try
+        {
+            tail.get();
+        }
+        catch (const std::runtime_error &)
+        {
+            refused = true;
+        }
+        assert(refused);
+    }
+}
+
+// a diamond with a tail, each node checks its predecessors have finished
+void test_task_graph()
+{
+    impl::thread_pool pool(1);
+    impl::task_graph g;
+    std::vector<std::atomic<int>> finished(5);
+    auto node = [&](int id, std::vector<int> preds) {
+        return g.emplace([&finished, id, preds]() {
+            for (int p : preds)
+                assert(finished[p].load() > finished[id].load());
+            finished[id].fetch_add(1);
+        });
+    };
+    auto a = node(0, {}), b = node(1, {0}), c = node(2, {0}), d = node(3, {1, 2}), e = node(4, {3});
+    g.precede(a, b), g.precede(a, c), g.precede(b, d), g.precede(c, d), g.precede(d, e);
+
+    g.run(pool).get();
+    for (auto &x : finished)
+        assert(x.load() == 1);
+
+    // the graph can be run again, and stages can wait for a graph without blocking
+    auto again = g.run(pool).then([&]() { return finished[4].load(); });
+    assert(again.get() == 2);
+
+    // cycles are rejected
+    g.precede(e, a);
+    bool thrown = false;
+    try
+    {
+        g.run(pool);
+    }
+    catch (const std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+// the order of the classes, and the starvation protection of the background class
+void test_priority()
+{
+    for (auto policy : {impl::schedule_policy::shared_queue, impl::schedule_policy::work_stealing})
+    {
+        // no starvation protection gets in the way of the order, however slow the machine
+        impl::pool_options opts;
+        opts.policy = policy;
+        opts.starvation_limit = std::chrono::hours(1);
+        impl::thread_pool pool(1, opts);
+
+        // hold the only worker while the queues fill up
+        std::promise<void> gate, started;
+        std::shared_future<void> opened = gate.get_future().share();
+        pool.post([opened, &started]() {
+            started.set_value();
+            opened.wait();
+        });
+        started.get_future().wait();
+
+        std::vector<int> order;
+        auto now = std::chrono::steady_clock::now();
+        auto log = [&order](int id) { order.push_back(id); };
+        pool.enqueue(impl::task_priority::background, log, 5);
+        pool.enqueue(log, 4);
+        pool.enqueue(impl::task_priority::normal, log, 3);
+        pool.enqueue(impl::task_priority::high, log, 2);
+        pool.enqueue(now - std::chrono::seconds(1), log, 0);
+        pool.enqueue(now + std::chrono::seconds(1), log, 1);
+        gate.set_value();
+        pool.enqueue(impl::task_priority::background, []() {}).get();
+        assert((order == std::vector<int>{0, 2, 1, 3, 4, 5}));
+        assert(pool.queue_latency(impl::task_priority::background).count == 2);
+
+        // a stream of high tasks, which keep each other going, does not starve the background class: the
+        // stream only ends once the background task has run
+        opts.starvation_limit = std::chrono::milliseconds(20);
+        impl::thread_pool stream_pool(1, opts);
+        std::atomic<bool> background_done(false);
+        std::function<void()> spin = [&]() {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            if (!background_done.load())
+                stream_pool.enqueue(impl::task_priority::high, spin);
+        };
+        stream_pool.enqueue(impl::task_priority::high, spin);
+        stream_pool.enqueue(impl::task_priority::background, [&]() { background_done = true; }).get();
+        assert(stream_pool.queue_latency(impl::task_priority::background).count == 1);
+    }
+}
+
+// The starvation protection and the high burst limit of the scheduler, on a clock the test moves by hand
+static impl::priority_scheduler::clock::time_point fake_now;
+
+void test_starvation()
+{
+    using namespace std::chrono_literals;
+    fake_now = impl::priority_scheduler::clock::time_point();
+    impl::priority_scheduler sched(20ms, 2, []() { return fake_now; });
+
+    std::vector<int> order;
+    auto push = [&](impl::task_priority prio, int id) {
+        sched.push(prio, fake_now, [&order, id]() { order.push_back(id); });
+    };
+    auto pop = [&](bool others_waiting = false) {
+        impl::unique_task task;
+        bool got = sched.pop_before_normal(task, others_waiting) || sched.pop_background(task);
+        assert(got);
+        task();
+    };
+
+    push(impl::task_priority::background, 100);
+    for (int i = 0; i < 6; ++i)
+        push(impl::task_priority::high, i);
+    push(impl::task_priority::normal, 50);
+
+    pop(), pop();  // 0 1
+    pop();         // the burst limit lets the normal task in: 50
+    pop();         // 2
+    fake_now += 19ms;
+    pop();         // 3, the background task has not waited long enough
+    fake_now += 1ms;
+    pop();         // 100, promoted before the high tasks
+    push(impl::task_priority::background, 101);
+    fake_now += 19ms;
+    pop();         // 4, a background task was served 19 ms ago
+    fake_now += 1ms;
+    pop(), pop();  // 101 5
+    assert((order == std::vector<int>{0, 1, 50, 2, 3, 100, 4, 101, 5}));
+    assert(sched.empty());
+}
+
+// p99 queue latency of a latency-critical class, behind a flood of bulk jobs
+void bench_priority()
+{
+    impl::thread_pool pool(2);
+
+    std::vector<impl::pool_future<void>> res;
+    auto bulk = []() { std::this_thread::sleep_for(std::chrono::microseconds(200)); };
+    for (int i = 0; i < 2000; ++i)
+        res.emplace_back(pool.enqueue(impl::task_priority::background, bulk));
+
+    for (int i = 0; i < 200; ++i)
+    {
+        auto prio = (i % 2) ? impl::task_priority::high : impl::task_priority::normal;
+        res.emplace_back(pool.enqueue(prio, []() {}));
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    for (auto &f : res)
+        f.get();
+
+    for (auto [prio, name] : {std::pair{impl::task_priority::high, "high"}, {impl::task_priority::normal, "normal"},
+                              {impl::task_priority::background, "background"}})
+    {
+        auto s = pool.queue_latency(prio);
+        std::printf("%-10s tasks = %4llu, queue wait p50 = %8.1f us, p99 = %8.1f us, max = %8.1f us\n", name,
+                    (unsigned long long)s.count, s.percentile(50) / 1e3, s.percentile(99) / 1e3, s.max / 1e3);
+    }
+}
+
+// the opt-in counters, in each scheduling mode
+void test_stats()
+{
+    for (size_t capacity : {0, 1024})
+    {
+        for (auto policy : {impl::schedule_policy::shared_queue, impl::schedule_policy::work_stealing})
+        {
+            impl::pool_options opts;
+            opts.policy = policy;
+            opts.queue_capacity = capacity;
+            opts.enable_stats = true;
+            impl::thread_pool pool(4, opts);
+
+            constexpr int N = 1000;
+            std::vector<impl::pool_future<void>> res;
+            for (int i = 0; i < N; ++i)
+                res.emplace_back(pool.enqueue([]() { std::this_thread::sleep_for(std::chrono::microseconds(10)); }));
+            for (auto &f : res)
+                f.get();
+
+            // the last future may be ready just before its worker updates the counters
+            impl::pool_stats s;
+            do
+                s = pool.stats();
+            while (s.run.count != N);
+
+            uint64_t completed = 0;
+            for (size_t i = 0; i < pool.size(); ++i)
+                completed += s.completed[i];
+            assert(completed == N && s.wait.count == N && s.queue_depth == 0);
+            assert(s.queue_high_water >= 1 && s.queue_high_water <= N);
+            assert(s.run.percentile(50) >= 10000);
+        }
+    }
+
+    // pushes rejected by a full ring leave the queue depth as it was
+    {
+        impl::pool_options opts;
+        opts.queue_capacity = 4;
+        opts.on_full = impl::full_policy::fail;
+        opts.enable_stats = true;
+        impl::thread_pool pool(1, opts);
+
+        std::promise<void> gate, started;
+        std::shared_future<void> opened = gate.get_future().share();
+        auto blocker = pool.enqueue([opened, &started]() {
+            started.set_value();
+            opened.wait();
+        });
+        started.get_future().wait();
+        std::vector<impl::pool_future<void>> queued;
+        int rejected = 0;
+        while (rejected < 8)
+        {
+            if (auto f = pool.try_enqueue([]() {}))
+                queued.push_back(std::move(*f));
+            else
+                rejected++;
+        }
+        assert(pool.stats().queue_depth == queued.size());
+
+        // a worker lowers the depth before it runs a task, so once the futures are ready the depth is final
+        gate.set_value();
+        blocker.get();
+        for (auto &f : queued)
+            f.get();
+        auto s = pool.stats();
+        // a rejected task is counted while its push is tried, it may show in the high water
+        assert(s.queue_depth == 0 && s.queue_high_water <= queued.size() + 1);
+    }
+
+    // disabled: nothing is collected
+    impl::thread_pool pool(2);
+    pool.enqueue([]() {}).get();
+    auto s = pool.stats();
+    assert(s.completed.empty() && s.wait.count == 0);
+}
+
+// grow under a backlog of blocking tasks, then shrink back once idle
+void test_elastic()
+{
+    for (auto policy : {impl::schedule_policy::shared_queue, impl::schedule_policy::work_stealing})
+    {
+        impl::pool_options opts;
+        opts.policy = policy;
+        opts.min_threads = 1;
+        opts.max_threads = 4;
+        opts.idle_timeout = std::chrono::milliseconds(20);
+        impl::thread_pool pool(1, opts);
+        assert(pool.size() == 1);
+
+        // 4 tasks which only finish together, so they must run on 4 workers at once
+        std::promise<void> gate;
+        std::shared_future<void> open = gate.get_future().share();
+        std::atomic<int> running(0);
+        std::vector<impl::pool_future<void>> res;
+        for (int i = 0; i < 4; ++i)
+            res.emplace_back(pool.enqueue([&running, open]() {
+                running.fetch_add(1);
+                open.wait();
+            }));
+        while (running.load() != 4)
+            std::this_thread::yield();
+        assert(pool.size() == 4);
+        gate.set_value();
+        for (auto &f : res)
+            f.get();
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (pool.size() > 1 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        assert(pool.size() == 1);
+
+        // retired slots are reused
+        std::atomic<int> sum(0);
+        pool.parallel_for(0, 1000, 1, [&](int i) { sum.fetch_add(i); });
+        assert(sum.load() == 999 * 1000 / 2);
+        assert(pool.enqueue(impl::task_priority::high, []() { return 1; }).get() == 1);
+    }
+
+    // min_threads = 0: the pool may run out of workers, and starts one on the next task
+    impl::pool_options opts;
+    opts.max_threads = 2;
+    opts.idle_timeout = std::chrono::milliseconds(1);
+    impl::thread_pool pool(0, opts);
+    for (int i = 0; i < 10; ++i)
+    {
+        assert(pool.enqueue([i]() { return i; }).get() == i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(i % 3));
+    }
+
+    // max_threads = 1: a task enqueued just as the only worker retires still finds a slot to start a worker in
+    for (auto policy : {impl::schedule_policy::shared_queue, impl::schedule_policy::work_stealing})
+    {
+        opts.policy = policy;
+        opts.max_threads = 1;
+        opts.idle_timeout = std::chrono::milliseconds(2);
+        impl::thread_pool single(1, opts);
+        for (int i = 0; i < 20; ++i)
+        {
+            while (single.size() != 0)
+                std::this_thread::yield();
+            auto f = single.enqueue([i]() { return i; });
+            assert(f.wait_for(std::chrono::seconds(5)) == std::future_status::ready && f.get() == i);
+        }
+    }
+}
+
+// every wait strategy runs everything, with gaps between the bursts so that workers spin out and park
+void test_wait_strategy()
+{
+    for (auto wait : {impl::wait_strategy::park, impl::wait_strategy::spin_then_park, impl::wait_strategy::spin})
+    {
+        for (size_t capacity : {0, 64})
+        {
+            impl::pool_options opts;
+            opts.policy = capacity ? impl::schedule_policy::shared_queue : impl::schedule_policy::work_stealing;
+            opts.queue_capacity = capacity;
+            opts.wait = wait;
+            opts.spin_time = std::chrono::microseconds(100);
+            impl::thread_pool pool(2, opts);
+
+            std::atomic<int> sum(0);
+            for (int burst = 0; burst < 10; ++burst)
+            {
+                std::vector<impl::pool_future<void>> res;
+                for (int i = 0; i < 100; ++i)
+                    res.emplace_back(pool.enqueue([&sum, i]() { sum.fetch_add(i); }));
+                for (auto &f : res)
+                    f.get();
+                std::this_thread::sleep_for(std::chrono::microseconds(burst * 50));
+            }
+            assert(sum.load() == 10 * 99 * 100 / 2);
+        }
+    }
+
+    // spinning workers of an elastic pool retire too
+    impl::pool_options opts;
+    opts.policy = impl::schedule_policy::work_stealing;
+    opts.wait = impl::wait_strategy::spin;
+    opts.min_threads = 1;
+    opts.max_threads = 3;
+    opts.idle_timeout = std::chrono::milliseconds(10);
+    impl::thread_pool pool(3, opts);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (pool.size() > 1 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    assert(pool.size() == 1);
+    assert(pool.enqueue([]() { return 7; }).get() == 7);
+}
+
+#ifdef __linux__
+// every worker runs on the one CPU it is pinned to
+void test_affinity()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &allowed))
+        ++cpu;
+
+    impl::pool_options opts;
+    opts.policy = impl::schedule_policy::work_stealing;
+    opts.cpus = {cpu};
+    impl::thread_pool pool(2, opts);
+    std::vector<impl::pool_future<int>> res;
+    for (int i = 0; i < 16; ++i)
+        res.emplace_back(pool.enqueue([]() { return sched_getcpu(); }));
+    for (auto &f : res)
+        assert(f.get() == cpu);
+}
+#endif
+
+// Compare the single-queue design and work stealing with many tiny tasks
+void bench_schedule_policy()
+{
+    constexpr int nr_tasks = 200000;
+    size_t nr_threads = std::max(4u, std::thread::hardware_concurrency());
+
+    auto run = [&](impl::pool_options opts, const char *name) {
+        std::atomic<int> done(0);
+        auto start = std::chrono::steady_clock::now();
+        {
+            impl::thread_pool pool(nr_threads, opts);
+            // every seed task fans out into small tasks from inside a worker
+            constexpr int fanout = 1000;
+            for (int i = 0; i < nr_tasks / fanout; ++i)
+            {
+                pool.post([&]() {
+                    for (int j = 0; j < fanout; ++j)
+                        pool.post([&]() { done.fetch_add(1, std::memory_order_relaxed); });
+                });
+            }
+            while (done.load() != nr_tasks)
+                std::this_thread::yield();
+        }
+        auto cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%-14s threads = %zu, tasks = %d, time = %.2f ms\n", name, nr_threads, nr_tasks, cost);
+    };
+
+    run({impl::schedule_policy::shared_queue}, "shared_queue");
+    run({impl::schedule_policy::shared_queue, 1 << 16}, "shared_ring");
+    run({impl::schedule_policy::work_stealing}, "work_stealing");
+    run({impl::schedule_policy::work_stealing, 1 << 16}, "stealing_ring");
+}
+
+// One future per chunk against one parallel_for
+void bench_parallel_for()
+{
+    static constexpr int N = 1 << 24, grain = 1 << 10;
+    std::vector<float> nums(N, 1.0f);
+    impl::thread_pool pool(std::max(4u, std::thread::hardware_concurrency()));
+
+    auto measure = [](const char *name, auto &&fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%-16s time = %.2f ms\n", name, cost);
+    };
+
+    measure("futures/chunk", [&]() {
+        std::vector<impl::pool_future<void>> res;
+        for (int lo = 0; lo < N; lo += grain)
+            res.emplace_back(pool.enqueue([&nums, lo]() {
+                for (int i = lo; i < lo + grain; ++i)
+                    nums[i] = nums[i] * 0.5f + 1.0f;
+            }));
+        for (auto &f : res)
+            f.get();
+    });
+
+    measure("parallel_for", [&]() {
+        pool.parallel_for(0, N, grain, [&](int i) { nums[i] = nums[i] * 0.5f + 1.0f; });
+    });
+}
+
+// The time from 'post' to the start of the task, for bursts of tiny tasks separated by short gaps: the gap
+// is shorter than the spin time, so a spinning worker is still awake when the next burst comes.
+void bench_wait_strategy()
+{
+    static constexpr int nr_bursts = 500, burst = 8;
+    const std::pair<impl::wait_strategy, const char *> strategies[] = {
+        {impl::wait_strategy::park, "park"},
+        {impl::wait_strategy::spin_then_park, "spin_then_park"},
+        {impl::wait_strategy::spin, "spin"},
+    };
+
+    for (auto [wait, name] : strategies)
+    {
+        impl::pool_options opts;
+        opts.policy = impl::schedule_policy::work_stealing;
+        opts.wait = wait;
+        opts.spin_time = std::chrono::microseconds(200);
+        impl::thread_pool pool(4, opts);
+
+        impl::latency_histogram latency;
+        auto start = std::chrono::steady_clock::now();
+        for (int b = 0; b < nr_bursts; ++b)
+        {
+            std::atomic<int> done(0);
+            for (int i = 0; i < burst; ++i)
+            {
+                auto posted = std::chrono::steady_clock::now();
+                pool.post([&latency, &done, posted]() {
+                    auto t = std::chrono::steady_clock::now() - posted;
+                    latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(t).count());
+                    done.fetch_add(1);
+                });
+            }
+            while (done.load() != burst)
+                std::this_thread::yield();
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+        auto cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        auto s = latency.read();
+        std::printf("%-14s tasks = %d, start latency p50 = %.1f us, p99 = %.1f us, time = %.2f ms\n", name,
+                    nr_bursts * burst, s.percentile(50) / 1e3, s.percentile(99) / 1e3, cost);
+    }
+}
+
+// What a pool under a burst of small tasks looks like, and what the counters cost
+void bench_stats()
+{
+    for (bool enabled : {false, true})
+    {
+        impl::pool_options opts;
+        opts.enable_stats = enabled;
+        impl::thread_pool pool(4, opts);
+
+        constexpr int N = 200000;
+        std::atomic<int> done(0);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < N; ++i)
+            pool.post([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+        while (done.load() != N)
+            std::this_thread::yield();
+        auto cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::printf("stats %-3s      tasks = %d, time = %.2f ms\n", enabled ? "on" : "off", N, cost);
+
+        if (!enabled)
+            continue;
+        auto s = pool.stats();
+        std::printf("queue depth = %zu, high water = %zu\n", s.queue_depth, s.queue_high_water);
+        std::printf("wait p50 = %.1f us, p99 = %.1f us; run p50 = %.1f us, p99 = %.1f us\n",
+                    s.wait.percentile(50) / 1e3, s.wait.percentile(99) / 1e3, s.run.percentile(50) / 1e3,
+                    s.run.percentile(99) / 1e3);
+        for (size_t i = 0; i < pool.size(); ++i)
+            std::printf("worker %zu: completed = %llu, busy = %.2f ms, idle = %.2f ms\n", i,
+                        (unsigned long long)s.completed[i], s.busy_ns[i] / 1e6, s.idle_ns[i] / 1e6);
+    }
+}
+
 int main()
 {
     // simple_test();
     test_sorting();
+    test_work_stealing();
+    test_bounded_queue();
+    test_task_allocations();
+    test_parallel_for();
+    test_continuations();
+    test_task_graph();
+    test_priority();
+    test_starvation();
+    test_stats();
+    test_elastic();
+    test_wait_strategy();
+#ifdef __linux__
+    test_affinity();
+#endif
+    bench_schedule_policy();
+    bench_parallel_for();
+    bench_priority();
+    bench_stats();
+    bench_wait_strategy();
 }
\ No newline at end of file
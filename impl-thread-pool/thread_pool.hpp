@@ -3,15 +3,114 @@
  * Copyright: https://github.com/progschj/ThreadPool
  */
 
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <system_error>
 #include <thread>
+#include <tuple>
 #include <vector>
 
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "histogram.hpp"
+#include "mpmc_queue.hpp"
+#include "pool_future.hpp"
+#include "priority_scheduler.hpp"
+#include "unique_task.hpp"
+
 namespace impl
 {
+/* How tasks are handed to the workers.
+ * - shared_queue: all workers pop from one queue protected by one mutex.
+ * - work_stealing: each worker owns a deque. Tasks enqueued by a worker go to its own deque (LIFO end),
+ *   tasks from other threads are spread round-robin, and an idle worker steals from the FIFO end of others.
+ */
+enum class schedule_policy
+{
+    shared_queue,
+    work_stealing
+};
+
+/* What 'enqueue' does when the bounded submission queue is full. 'try_enqueue' never waits. */
+enum class full_policy
+{
+    block, // park the producer until a worker frees a slot
+    spin,  // yield and retry until a slot is free
+    fail   // throw std::runtime_error
+};
+
+/* What an idle worker does before it finds a task. Waking a parked worker costs a futex round-trip (several
+ * microseconds), which is more than a tiny task, while spinning burns the core. With the shared_queue policy
+ * and no bounded queue, the workers always park.
+ */
+enum class wait_strategy
+{
+    park,           // sleep on the condition variable at once
+    spin_then_park, // poll for 'spin_time' (pause, then yield) before sleeping
+    spin            // poll until a task comes, never sleep (an elastic pool still retires after 'idle_timeout')
+};
+
+/* The return type of a task, 'f' is invoked with the stored copies of 'args' (as lvalues, like std::bind does). */
+template <class F, class... Args>
+using task_result_t = std::invoke_result_t<std::decay_t<F> &, std::decay_t<Args> &...>;
+
+struct pool_options
+{
+    schedule_policy policy = schedule_policy::shared_queue;
+
+    // 0 for the unbounded mutex-protected queue. Otherwise tasks from non-worker threads (and all tasks with the
+    // shared_queue policy) go through a lock-free ring of this capacity, rounded up to a power of 2.
+    size_t queue_capacity = 0;
+    full_policy on_full = full_policy::block;
+
+    // For the tasks enqueued with a task_priority or a deadline, see priority_scheduler.hpp
+    std::chrono::microseconds starvation_limit{10000};
+    unsigned high_burst = 16;
+
+    wait_strategy wait = wait_strategy::park;
+    std::chrono::microseconds spin_time{50};
+
+    // Collect the numbers returned by thread_pool::stats(), which costs two clock reads per task
+    bool enable_stats = false;
+
+    // An elastic pool, when max_threads > 0: it starts with 'nr_threads' workers (clamped to [min, max]), starts
+    // one more whenever the queued tasks outnumber the idle workers, up to 'max_threads', and a worker which has
+    // been idle for 'idle_timeout' exits, down to 'min_threads'. Otherwise the pool keeps 'nr_threads' workers.
+    size_t min_threads = 0, max_threads = 0;
+    std::chrono::milliseconds idle_timeout{1000};
+
+    // Pin worker i to the CPU cpus[i % cpus.size()], empty for no pinning. Linux only, ignored elsewhere.
+    std::vector<int> cpus{};
+};
+
+/* A snapshot of the counters of a pool with pool_options::enable_stats, durations are in nanoseconds. */
+struct pool_stats
+{
+    size_t queue_depth;      // tasks enqueued and not started yet
+    size_t queue_high_water; // the largest 'queue_depth' seen
+    latency_histogram::snapshot wait, run;   // per task: the time in the queue, and the time to run
+    std::vector<uint64_t> completed;         // per worker slot: tasks run
+    std::vector<uint64_t> busy_ns, idle_ns;  // per worker slot: running tasks, and spinning or parked
+};
+
 class thread_pool
 {
   public:
@@ -20,31 +119,41 @@ class thread_pool
     thread_pool &operator=(const thread_pool &) = delete;
     thread_pool &operator=(thread_pool &&) = delete;
 
-    thread_pool(size_t nr_threads) : stop(false)
+    thread_pool(size_t nr_threads, schedule_policy policy = schedule_policy::shared_queue)
+        : thread_pool(nr_threads, pool_options{policy})
     {
-        auto worker_entry = [this]() {
-            while (1)
-            {
-                std::function<void()> task;
-                // pop a task from queue 'tasks', and execute it
-                {
-                    std::unique_lock lock(mtx);
-                    cv.wait(lock, [this]() { return stop || !tasks.empty(); });
-                    if (stop && tasks.empty())
-                        return;
-                    // even if stop = 1, but 'tasks' is not empty, then
-                    // excucte the task until tasks queue become empty
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                }
-                task();
-            }
-        };
+    }
+
+    thread_pool(size_t nr_threads, pool_options opts)
+        : stop(false), policy(opts.policy), on_full(opts.on_full), pending(0), sleepers(0), next_queue(0),
+          blocked_producers(0), wait(opts.wait), spin_time(opts.spin_time), spinning(0),
+          prio(opts.starvation_limit, opts.high_burst), stats_enabled(opts.enable_stats), depth(0), high_water(0),
+          max_threads(opts.max_threads > 0 ? opts.max_threads : nr_threads),
+          min_threads(opts.max_threads > 0 ? std::min(opts.min_threads, max_threads) : nr_threads),
+          idle_timeout(opts.idle_timeout), cpus(std::move(opts.cpus)), live(0)
+    {
+        // Everything indexed by worker is allocated for 'max_threads' slots up front, a new worker reuses the
+        // slot of a retired one
+        if (stats_enabled)
+        {
+            for (size_t i = 0; i < max_threads; ++i)
+                counters.emplace_back(std::make_unique<worker_counters>());
+        }
+
+        if (opts.queue_capacity > 0)
+            ring = std::make_unique<mpmc_queue<unique_task>>(opts.queue_capacity);
 
-        for (size_t i = 0; i < nr_threads; ++i)
+        if (policy == schedule_policy::work_stealing)
         {
-            workers.emplace_back(std::thread(worker_entry));
+            for (size_t i = 0; i < max_threads; ++i)
+                queues.emplace_back(std::make_unique<worker_queue>());
         }
+
+        workers.resize(max_threads);
+        active = std::make_unique<std::atomic<bool>[]>(max_threads);
+        std::unique_lock lock(grow_mtx);
+        for (size_t i = 0; i < std::clamp(nr_threads, min_threads, max_threads); ++i)
+            start_worker(i);
     }
     virtual ~thread_pool()
     {
@@ -54,41 +163,883 @@ class thread_pool
             stop = true;
         }
         cv.notify_all();
+        {
+            std::unique_lock lock(space_mtx);
+        }
+        space_cv.notify_all();
+
+        // 'grow_mtx' keeps the workers, which are draining the queues, from starting new workers
+        std::unique_lock lock(grow_mtx);
         for (auto &worker : workers)
-            worker.join();
+        {
+            if (worker.joinable())
+                worker.join();
+        }
     }
 
-    template <class F, class... Args> std::future<std::result_of_t<F(Args...)>> enqueue(F &&f, Args &&...args)
+    template <class F, class... Args> pool_future<task_result_t<F, Args...>> enqueue(F &&f, Args &&...args)
     {
-        // The return type of task `F`
-        using return_type = std::result_of_t<F(Args...)>;
+        auto [task, res] = make_task(std::forward<F>(f), std::forward<Args>(args)...);
+        if (!push_task(task, on_full))
+            throw std::runtime_error("The task queue is full.");
+        return std::move(res);
+    }
+
+    // Enqueue with a priority class, higher classes are served first (with starvation protection)
+    template <class F, class... Args>
+    pool_future<task_result_t<F, Args...>> enqueue(task_priority priority, F &&f, Args &&...args)
+    {
+        auto [task, res] = make_task(std::forward<F>(f), std::forward<Args>(args)...);
+        push_priority(priority, priority_scheduler::clock::now(), std::move(task));
+        return std::move(res);
+    }
+
+    // Enqueue in the high class, which is served earliest deadline first
+    template <class F, class... Args>
+    pool_future<task_result_t<F, Args...>> enqueue(std::chrono::steady_clock::time_point deadline, F &&f,
+                                                   Args &&...args)
+    {
+        auto [task, res] = make_task(std::forward<F>(f), std::forward<Args>(args)...);
+        push_priority(task_priority::high, deadline, std::move(task));
+        return std::move(res);
+    }
+
+    // How long the tasks of one class have waited in the queue (in nanoseconds), for the tasks enqueued with a
+    // task_priority or a deadline only, the untagged tasks are not timed
+    latency_histogram::snapshot queue_latency(task_priority priority) const
+    {
+        return prio.queue_latency(priority);
+    }
+
+    // Aggregate the per-worker counters, all zero unless pool_options::enable_stats is set
+    pool_stats stats() const
+    {
+        pool_stats s = {depth.load(std::memory_order_relaxed), high_water.load(std::memory_order_relaxed), {}, {},
+                        {}, {}, {}};
+        for (auto &c : counters)
+        {
+            s.wait.merge(c->wait.read());
+            s.run.merge(c->run.read());
+            s.completed.push_back(c->completed.load(std::memory_order_relaxed));
+            s.busy_ns.push_back(c->busy_ns.load(std::memory_order_relaxed));
+            s.idle_ns.push_back(c->idle_ns.load(std::memory_order_relaxed));
+        }
+        return s;
+    }
+
+    // Same as 'enqueue', but return std::nullopt instead of waiting when the bounded queue is full
+    template <class F, class... Args>
+    std::optional<pool_future<task_result_t<F, Args...>>> try_enqueue(F &&f, Args &&...args)
+    {
+        auto [task, res] = make_task(std::forward<F>(f), std::forward<Args>(args)...);
+        if (!push_task(task, full_policy::fail))
+            return std::nullopt;
+        return std::move(res);
+    }
+
+    // Fire-and-forget, no future is created. A small callable is stored inline in the task, so this does
+    // not allocate at all with the bounded queue (the std::deque based queues allocate a chunk now and then).
+    template <class F, class... Args> void post(F &&f, Args &&...args)
+    {
+        unique_task task(bind_args(std::forward<F>(f), std::forward<Args>(args)...));
+        if (!push_task(task, on_full))
+            throw std::runtime_error("The task queue is full.");
+    }
+
+    // The number of workers, which changes over time in an elastic pool
+    size_t size() const
+    {
+        return live.load();
+    }
+
+#if defined(__cpp_impl_coroutine)
+    /* 'co_await pool.schedule()' suspends the coroutine, and resumes it on one of the workers. */
+    struct schedule_awaiter
+    {
+        thread_pool &pool;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            pool.post([h]() { h.resume(); });
+        }
+        void await_resume() const noexcept
+        {
+        }
+    };
 
-        // make wrapper for F(args...) to have no arguments
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    schedule_awaiter schedule()
+    {
+        return {*this};
+    }
+#endif
+
+    // Call 'fn' over [begin, end). 'fn' is either 'fn(i)' for each index, or 'fn(lo, hi)' for each chunk.
+    // The calling thread works on the range as well, and returns when the whole range is done. The first
+    // exception thrown by 'fn' is rethrown here, the chunks which have not started yet are skipped then.
+    template <class Index, class F> void parallel_for(Index begin, Index end, Index grain, F &&fn)
+    {
+        auto body = [&fn](Index lo, Index hi) {
+            if constexpr (std::is_invocable_v<F &, Index, Index>)
+                fn(lo, hi);
+            else
+            {
+                for (Index i = lo; i < hi; ++i)
+                    fn(i);
+            }
+            return nullptr;
+        };
+        auto reduce = [](std::nullptr_t, std::nullptr_t) { return nullptr; };
+        run_range(begin, end, grain, nullptr, body, reduce);
+    }
+
+    // Reduce [begin, end) to 'reduce(... reduce(init, map(begin)) ..., map(end - 1))'. 'map' is either 'map(i)'
+    // for each index, or 'map(lo, hi)' returning the partial result of a chunk. The partial results are
+    // combined in no particular order, so 'reduce' must be associative and commutative.
+    template <class Index, class T, class Map, class Reduce>
+    T parallel_reduce(Index begin, Index end, Index grain, T init, Map &&map, Reduce &&reduce)
+    {
+        auto body = [&map, &reduce](Index lo, Index hi) -> T {
+            if constexpr (std::is_invocable_v<Map &, Index, Index>)
+                return map(lo, hi);
+            else
+            {
+                T acc = map(lo);
+                for (Index i = lo + 1; i < hi; ++i)
+                    acc = reduce(std::move(acc), map(i));
+                return acc;
+            }
+        };
+        return run_range(begin, end, grain, std::move(init), body, reduce);
+    }
+
+  private:
+    /* The state shared by all threads working on one parallel_for/parallel_reduce. Threads claim chunks
+     * from 'next' until the range is exhausted. The chunk size starts large and shrinks as the range is
+     * consumed (guided self-scheduling), but never goes below 'grain'.
+     */
+    template <class Index, class T, class Body, class Reduce> struct range_job
+    {
+        std::atomic<Index> next;
+        Index end, grain;
+        size_t participants;
+        Body &body;
+        Reduce &reduce;
+
+        // The latch, 'done' counts the indices whose partial result has been merged into 'result'
+        std::mutex mtx;
+        std::condition_variable cv;
+        size_t done, total;
+        T result;
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+
+        range_job(Index begin, Index end, Index grain, size_t participants, Body &body, Reduce &reduce, T init)
+            : next(begin), end(end), grain(grain), participants(participants), body(body), reduce(reduce), done(0),
+              total(end - begin), result(std::move(init)), failed(false)
+        {
+        }
+
+        bool claim(Index &lo, Index &hi)
+        {
+            Index cur = next.load(std::memory_order_relaxed);
+            while (cur < end)
+            {
+                Index size = std::max<Index>(grain, (end - cur) / Index(2 * participants));
+                Index stop = (end - cur > size) ? cur + size : end;
+                if (next.compare_exchange_weak(cur, stop, std::memory_order_relaxed))
+                {
+                    lo = cur, hi = stop;
+                    return true;
+                }
+            }
+            return false;
+        }
 
-        std::future<return_type> res = task->get_future();
+        // 'body' and 'reduce' live on the stack of the caller, they are only touched after a successful
+        // claim, and the caller does not return before every claimed chunk is merged.
+        void participate()
         {
+            Index lo, hi;
+            size_t count = 0;
+            std::optional<T> partial;
+            while (claim(lo, hi))
+            {
+                count += hi - lo;
+                if (failed.load(std::memory_order_relaxed))
+                    continue;
+                try
+                {
+                    T v = body(lo, hi);
+                    partial = partial ? reduce(std::move(*partial), std::move(v)) : std::move(v);
+                }
+                catch (...)
+                {
+                    std::unique_lock lock(mtx);
+                    if (!error)
+                        error = std::current_exception();
+                    failed = true;
+                }
+            }
+
+            if (count == 0)
+                return;
             std::unique_lock lock(mtx);
+            if (partial && !failed)
+                result = reduce(std::move(result), std::move(*partial));
+            done += count;
+            if (done == total)
+                cv.notify_all();
+        }
+    };
+
+    template <class Index, class T, class Body, class Reduce>
+    T run_range(Index begin, Index end, Index grain, T init, Body &body, Reduce &reduce)
+    {
+        if (!(begin < end))
+            return init;
+        grain = std::max<Index>(grain, 1);
+
+        size_t nr_chunks = (end - begin + grain - 1) / grain;
+        size_t nr_helpers = std::min(size(), nr_chunks - 1);
+        auto job = std::make_shared<range_job<Index, T, Body, Reduce>>(begin, end, grain, nr_helpers + 1, body,
+                                                                       reduce, std::move(init));
 
-            if (stop)
+        // Helpers are optional, we stop adding them if the bounded queue is full
+        unique_task helper;
+        push_tasks(
+            nr_helpers,
+            [&]() -> unique_task & {
+                helper = [job]() { job->participate(); };
+                return helper;
+            },
+            full_policy::fail);
+
+        job->participate();
+
+        std::unique_lock lock(job->mtx);
+        job->cv.wait(lock, [&]() { return job->done == job->total; });
+        if (job->error)
+            std::rethrow_exception(job->error);
+        return std::move(job->result);
+    }
+
+    /* A deque owned by one worker in the work_stealing policy. */
+    struct worker_queue
+    {
+        std::mutex mtx;
+        std::deque<unique_task> tasks;
+    };
+
+    /* The pool and the worker index of the current thread, {nullptr, 0} for non-worker threads. */
+    struct worker_context
+    {
+        thread_pool *pool;
+        size_t index;
+    };
+    static inline thread_local worker_context current = {nullptr, 0};
+
+    // Bind 'args' to 'f', the result is invoked as 'f(args...)' with the stored copies of 'args'
+    template <class F, class... Args> static auto bind_args(F &&f, Args &&...args)
+    {
+        // decltype(auto), so that a task returning a reference does not return a copy
+        return [f = std::forward<F>(f),
+                args = std::make_tuple(std::forward<Args>(args)...)]() mutable -> decltype(auto) {
+            return std::apply(f, args);
+        };
+    }
+
+    template <class F, class... Args> static auto make_task(F &&f, Args &&...args)
+    {
+        // The return type of task `F`
+        using return_type = task_result_t<F, Args...>;
+
+        // The state shared with the future is the only thing allocated here, 'f' and 'args' live in the task,
+        // inline when they are small
+        auto state = std::make_shared<result_state<return_type>>();
+        pool_future<return_type> res(state);
+        auto fn = bind_args(std::forward<F>(f), std::forward<Args>(args)...);
+        unique_task task(result_task<return_type, decltype(fn)>(std::move(state), std::move(fn)));
+        return std::pair{std::move(task), std::move(res)};
+    }
+
+    // Return false if the bounded queue is full and 'when_full' is full_policy::fail, 'task' is left untouched then
+    bool push_task(unique_task &task, full_policy when_full)
+    {
+        return push_tasks(1, [&task]() -> unique_task & { return task; }, when_full) == 1;
+    }
+
+    // Push 'n' tasks produced by 'make()' in one step: the mutex-protected queue is locked once, and parked
+    // workers are woken once. Return the number of pushed tasks, which is less than 'n' only if the bounded
+    // queue is full and 'when_full' is full_policy::fail.
+    template <class Make> size_t push_tasks(size_t n, Make &&make, full_policy when_full)
+    {
+        if (policy == schedule_policy::shared_queue && ring == nullptr)
+        {
+            size_t backlog, idle;
+            {
+                std::unique_lock lock(mtx);
+
+                if (stop)
+                    throw std::runtime_error("The thread pool has been stop.");
+
+                for (size_t i = 0; i < n; ++i)
+                    tasks.emplace(std::move(stamp(make())));
+                backlog = tasks.size() + prio.size();
+                idle = sleepers.load(); // the workers wait while holding 'mtx', so this is exact
+            }
+            if (idle == 1 || (idle > 0 && n == 1))
+                cv.notify_one();
+            else if (idle > 0)
+                cv.notify_all();
+            maybe_grow(backlog);
+            return n;
+        }
+
+        if (stop.load())
+            throw std::runtime_error("The thread pool has been stop.");
+
+        size_t pushed = 0;
+        bool from_worker = (current.pool == this);
+        for (; pushed < n; ++pushed)
+        {
+            unique_task &task = stamp(make());
+            if (policy == schedule_policy::work_stealing && (from_worker || ring == nullptr))
+            {
+                // 'pending' is raised before the task becomes visible, so a worker never sees an empty pool
+                // (and exits on stop) while a task is still on its way into a deque.
+                pending.fetch_add(1);
+
+                // A task enqueued by one of our workers stays local, others are spread round-robin
+                size_t idx = from_worker ? current.index : next_queue.fetch_add(1, std::memory_order_relaxed);
+                auto &q = *queues[idx % queues.size()];
+                std::unique_lock lock(q.mtx);
+                q.tasks.emplace_back(std::move(task));
+            }
+            else
+            {
+                // Counted after the push, or workers would spin on 'pending' while we wait for a free slot.
+                // A task which is not queued after all leaves the stats too.
+                bool queued;
+                try
+                {
+                    queued = push_ring(task, when_full);
+                }
+                catch (...)
+                {
+                    unstamp();
+                    throw;
+                }
+                if (!queued)
+                {
+                    unstamp();
+                    break;
+                }
+                pending.fetch_add(1);
+            }
+        }
+
+        if (pushed > 0)
+        {
+            wake_workers(pushed);
+            maybe_grow(queued());
+        }
+        return pushed;
+    }
+
+    void push_priority(task_priority priority, priority_scheduler::clock::time_point deadline, unique_task task)
+    {
+        if (stop.load())
+            throw std::runtime_error("The thread pool has been stop.");
+        stamp(task);
+
+        if (policy == schedule_policy::shared_queue && ring == nullptr)
+        {
+            // workers check 'prio' while holding 'mtx', so taking it after the push is enough to not lose a wakeup
+            prio.push(priority, deadline, std::move(task));
+            size_t backlog, idle;
+            {
+                std::unique_lock lock(mtx);
+                backlog = tasks.size() + prio.size();
+                idle = sleepers.load();
+            }
+            if (idle > 0)
+                cv.notify_one();
+            maybe_grow(backlog);
+            return;
+        }
+
+        pending.fetch_add(1);
+        prio.push(priority, deadline, std::move(task));
+        wake_workers(1);
+        maybe_grow(queued());
+    }
+
+    bool push_ring(unique_task &task, full_policy when_full)
+    {
+        while (!ring->try_push(task))
+        {
+            if (when_full == full_policy::fail)
+                return false;
+            if (stop.load())
                 throw std::runtime_error("The thread pool has been stop.");
 
-            // wrapper for no returned value
-            tasks.emplace([task]() -> void { (*task)(); });
+            // A worker must not wait for a slot, all workers could end up waiting for each other.
+            // It runs one queued task itself instead, which frees a slot as well.
+            unique_task other;
+            if (current.pool == this && ring->try_pop(other))
+            {
+                pending.fetch_sub(1);
+                run_task(other);
+                continue;
+            }
+
+            if (when_full == full_policy::spin)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // Same handshake as parking a worker, with 'blocked_producers' in place of 'sleepers'
+            std::unique_lock lock(space_mtx);
+            blocked_producers.fetch_add(1);
+            if (ring->try_push(task))
+            {
+                blocked_producers.fetch_sub(1);
+                return true;
+            }
+            space_cv.wait(lock);
+            blocked_producers.fetch_sub(1);
+        }
+        return true;
+    }
+
+    // Only touch the global mutex when some worker is parked on 'cv'
+    void wake_workers(size_t n)
+    {
+        if (sleepers.load() > 0)
+        {
+            {
+                std::unique_lock lock(mtx);
+            }
+            if (n == 1)
+                cv.notify_one();
+            else
+                cv.notify_all();
         }
+    }
 
-        cv.notify_one();
-        return res;
+    // A slot of the ring has been freed, only touch 'space_mtx' when some producer is parked on 'space_cv'
+    void wake_producer()
+    {
+        // A read-modify-write rather than a load: it is ordered against the fetch_add of a producer about to
+        // park, so either we see that producer, or it sees the slot we have just freed.
+        if (blocked_producers.fetch_add(0) > 0)
+        {
+            {
+                std::unique_lock lock(space_mtx);
+            }
+            space_cv.notify_one();
+        }
+    }
+
+    // Start a worker in slot 'i', which the caller has taken, with 'grow_mtx' held
+    void start_worker(size_t i)
+    {
+        // A retired worker which used this slot has finished already, or is about to
+        if (workers[i].joinable())
+            workers[i].join();
+
+        active[i] = true;
+        live.fetch_add(1);
+        try
+        {
+            workers[i] = std::thread([this, i]() {
+                current = {this, i};
+                if (!cpus.empty())
+                    pin_to_cpu(cpus[i % cpus.size()]);
+                if (this->policy == schedule_policy::shared_queue && ring == nullptr)
+                    shared_worker_entry();
+                else
+                    worker_entry(i);
+            });
+        }
+        catch (...)
+        {
+            live.fetch_sub(1);
+            active[i] = false;
+            throw;
+        }
+    }
+
+    // Elastic pools only: start one more worker if the queued tasks outnumber the idle workers. Called after
+    // a task is pushed, and after a worker pops one, so a backlog is noticed even if every push saw idle workers.
+    // A ring task is counted in 'pending' after the push, so a worker may pop and uncount it first, and
+    // 'pending' dips below 0 for a moment. Read it through here where a count is needed.
+    size_t queued() const
+    {
+        ptrdiff_t n = pending.load();
+        return n > 0 ? n : 0;
+    }
+
+    void maybe_grow(size_t backlog)
+    {
+        if (min_threads == max_threads || backlog <= sleepers.load() + spinning.load() || live.load() >= max_threads)
+            return;
+
+        // Another thread is starting a worker already, never wait for it
+        std::unique_lock lock(grow_mtx, std::try_to_lock);
+        if (!lock.owns_lock() || stop.load() || live.load() >= max_threads)
+            return;
+        for (size_t i = 0; i < max_threads; ++i)
+        {
+            // A retiring worker may take its slot back, see 'try_retire'
+            bool taken = false;
+            if (active[i].compare_exchange_strong(taken, true))
+            {
+                // Growing is best effort, the current workers will run the tasks anyway
+                try
+                {
+                    start_worker(i);
+                }
+                catch (const std::system_error &)
+                {
+                }
+                return;
+            }
+        }
+    }
+
+    // Called by a worker of an elastic pool which has been idle for 'idle_timeout', with 'mtx' held if it parks
+    bool try_retire()
+    {
+        size_t n = live.load(), self = current.index;
+        while (n > min_threads)
+        {
+            if (live.compare_exchange_weak(n, n - 1))
+            {
+                // Free the slot along with 'live', so a producer which sees the lower count finds a slot to start
+                // a worker in. Then the same handshake as parking, with 'live' in place of 'sleepers': a task
+                // enqueued meanwhile is ours, unless a producer has taken the slot already, its worker runs the
+                // task then (and joins this thread first).
+                active[self] = false;
+                if (pending.load() == 0)
+                    return true;
+                bool taken = false;
+                if (!active[self].compare_exchange_strong(taken, true))
+                    return true;
+                live.fetch_add(1);
+                return false;
+            }
+        }
+        return false;
+    }
+
+    static void pin_to_cpu(int cpu)
+    {
+#ifdef __linux__
+        // Fails for a CPU outside of the allowed set of the process, the worker floats then
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpu;
+#endif
+    }
+
+    static void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Poll 'pending' for 'limit' at most, with a backoff from one pause to 32 pauses per poll, then a yield per
+    // poll. Return true if a task is pending (or the pool stops). Called while counted in 'spinning'.
+    bool spin_wait(std::chrono::steady_clock::duration limit)
+    {
+        uint64_t start = now_ns();
+        uint64_t until = start + std::chrono::duration_cast<std::chrono::nanoseconds>(limit).count();
+        bool found = false;
+        for (unsigned round = 0;; ++round)
+        {
+            if (pending.load(std::memory_order_relaxed) > 0 || stop.load(std::memory_order_relaxed))
+            {
+                found = true;
+                break;
+            }
+            if (round < 6)
+            {
+                for (unsigned k = 0; k < (1u << round); ++k)
+                    cpu_relax();
+            }
+            else
+                std::this_thread::yield();
+            if (now_ns() >= until)
+                break;
+        }
+
+        if (stats_enabled)
+        {
+            auto &c = *counters[current.index];
+            c.idle_ns.store(c.idle_ns.load(std::memory_order_relaxed) + now_ns() - start, std::memory_order_relaxed);
+        }
+        return found;
+    }
+
+    static uint64_t now_ns()
+    {
+        auto t = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+    }
+
+    // Called for every task about to be queued
+    unique_task &stamp(unique_task &task)
+    {
+        if (stats_enabled)
+        {
+            task.stamp = now_ns();
+            size_t d = depth.fetch_add(1, std::memory_order_relaxed) + 1;
+            size_t hw = high_water.load(std::memory_order_relaxed);
+            while (d > hw && !high_water.compare_exchange_weak(hw, d, std::memory_order_relaxed))
+                ;
+        }
+        return task;
+    }
+
+    // Undo 'stamp' for a task which could not be queued
+    void unstamp()
+    {
+        if (stats_enabled)
+            depth.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Called by the workers for every task, the counters are only written by their own worker
+    void run_task(unique_task &task)
+    {
+        if (!stats_enabled)
+            return task();
+
+        auto &c = *counters[current.index];
+        depth.fetch_sub(1, std::memory_order_relaxed);
+        uint64_t start = now_ns();
+        c.wait.record(start - task.stamp);
+        task();
+        uint64_t cost = now_ns() - start;
+        c.run.record(cost);
+        c.busy_ns.store(c.busy_ns.load(std::memory_order_relaxed) + cost, std::memory_order_relaxed);
+        c.completed.store(c.completed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // cv.wait, and count the time as idle. In an elastic pool, wait 'idle_timeout' at most and return false
+    // if it expired with 'pred' still false.
+    template <class Pred> bool idle_wait(std::unique_lock<std::mutex> &lock, Pred pred)
+    {
+        uint64_t start = stats_enabled ? now_ns() : 0;
+        bool woken = true;
+        if (min_threads < max_threads)
+            woken = cv.wait_for(lock, idle_timeout, pred);
+        else
+            cv.wait(lock, pred);
+
+        if (stats_enabled)
+        {
+            auto &c = *counters[current.index];
+            c.idle_ns.store(c.idle_ns.load(std::memory_order_relaxed) + now_ns() - start, std::memory_order_relaxed);
+        }
+        return woken;
+    }
+
+    void shared_worker_entry()
+    {
+        while (1)
+        {
+            unique_task task;
+            size_t backlog;
+            // pop a task from queue 'tasks' (or 'prio'), and execute it
+            {
+                std::unique_lock lock(mtx);
+                sleepers.fetch_add(1);
+                bool woken = idle_wait(lock, [this]() { return stop || !tasks.empty() || !prio.empty(); });
+                sleepers.fetch_sub(1);
+                if (stop && tasks.empty() && prio.empty())
+                    return;
+                if (!woken)
+                {
+                    if (try_retire())
+                        return;
+                    continue;
+                }
+                // even if stop = 1, but 'tasks' is not empty, then
+                // excucte the task until tasks queue become empty
+                if (!prio.pop_before_normal(task, !tasks.empty()))
+                {
+                    if (!tasks.empty())
+                    {
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    else if (!prio.pop_background(task))
+                        continue;
+                }
+                backlog = tasks.size() + prio.size();
+            }
+            maybe_grow(backlog);
+            run_task(task);
+        }
+    }
+
+    // The high (and tagged normal) tasks, then the untagged ones, then the background ones
+    bool try_pop(size_t self, unique_task &task)
+    {
+        if (prio.pop_before_normal(task, queued() > prio.size()))
+        {
+            pending.fetch_sub(1);
+            return true;
+        }
+        if (pop_normal(self, task))
+            return true;
+        if (prio.pop_background(task))
+        {
+            pending.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    // Pop from the back of our own deque, then the ring, otherwise steal from the front of the others.
+    bool pop_normal(size_t self, unique_task &task)
+    {
+        size_t n = queues.size();
+        for (size_t k = 0; k < n; ++k)
+        {
+            if (k == 1 && pop_ring(task))
+                return true;
+
+            auto &q = *queues[(self + k) % n];
+            std::unique_lock lock(q.mtx);
+            if (q.tasks.empty())
+                continue;
+            if (k == 0)
+                task = std::move(q.tasks.back()), q.tasks.pop_back();
+            else
+                task = std::move(q.tasks.front()), q.tasks.pop_front();
+            pending.fetch_sub(1);
+            return true;
+        }
+        return (n <= 1) && pop_ring(task);
+    }
+
+    bool pop_ring(unique_task &task)
+    {
+        if (ring == nullptr || !ring->try_pop(task))
+            return false;
+        pending.fetch_sub(1);
+        wake_producer();
+        return true;
+    }
+
+    void worker_entry(size_t self)
+    {
+        unique_task task;
+        while (1)
+        {
+            if (try_pop(self, task))
+            {
+                maybe_grow(queued());
+                run_task(task);
+                task = nullptr;
+                continue;
+            }
+
+            // Nothing to run or steal. Spin first, a producer does not notify spinning workers.
+            if (wait != wait_strategy::park)
+            {
+                spinning.fetch_add(1);
+                bool found = spin_wait(wait == wait_strategy::spin ? std::chrono::steady_clock::duration(idle_timeout)
+                                                                   : std::chrono::steady_clock::duration(spin_time));
+                spinning.fetch_sub(1);
+                if (stop && pending.load() == 0)
+                    return;
+                if (found)
+                    continue;
+                if (wait == wait_strategy::spin)
+                {
+                    if (min_threads < max_threads && try_retire())
+                        return;
+                    continue;
+                }
+            }
+
+            // Park until something is enqueued. The pusher raises 'pending' before reading 'sleepers',
+            // and we raise 'sleepers' before reading 'pending', so at least one side sees the other and
+            // a wakeup cannot be lost.
+            std::unique_lock lock(mtx);
+            sleepers.fetch_add(1);
+            bool woken = idle_wait(lock, [this]() { return stop || pending.load() > 0; });
+            sleepers.fetch_sub(1);
+            if (stop && pending.load() == 0)
+                return;
+            if (!woken && try_retire())
+                return;
+        }
     }
 
-  private:
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    std::queue<unique_task> tasks;
 
     /* For sync usage, protect the `tasks` queue and `stop` flag. */
     std::mutex mtx;
     std::condition_variable cv;
-    bool stop;
+    std::atomic<bool> stop;
+
+    /* For the work_stealing policy and the bounded ring. */
+    schedule_policy policy;
+    full_policy on_full;
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::unique_ptr<mpmc_queue<unique_task>> ring;
+    std::atomic<ptrdiff_t> pending; // number of tasks in all deques and the ring, see 'queued'
+    std::atomic<size_t> sleepers;   // number of workers waiting on 'cv'
+    std::atomic<size_t> next_queue; // round-robin cursor for tasks from non-worker threads
+
+    /* Producers waiting for a free slot of the ring, with full_policy::block. */
+    std::mutex space_mtx;
+    std::condition_variable space_cv;
+    std::atomic<size_t> blocked_producers;
+
+    /* How the workers of worker_entry wait, see wait_strategy. */
+    const wait_strategy wait;
+    const std::chrono::microseconds spin_time;
+    std::atomic<size_t> spinning; // number of workers in spin_wait
+
+    /* Tasks enqueued with a task_priority or a deadline, also counted in 'pending'. */
+    priority_scheduler prio;
+
+    /* Only with pool_options::enable_stats, one cache line aligned block per worker. */
+    struct alignas(64) worker_counters
+    {
+        std::atomic<uint64_t> completed{0}, busy_ns{0}, idle_ns{0};
+        latency_histogram wait, run;
+    };
+    const bool stats_enabled;
+    std::vector<std::unique_ptr<worker_counters>> counters;
+    std::atomic<size_t> depth, high_water;
+
+    /* The worker count. 'workers' has 'max_threads' slots, 'active' tells which ones are taken: set before a
+     * worker starts, cleared when it decides to retire, while its thread may still be exiting. 'live' is raised
+     * before a worker starts and lowered when it decides to retire, so it never undercounts.
+     */
+    const size_t max_threads, min_threads;
+    const std::chrono::milliseconds idle_timeout;
+    const std::vector<int> cpus;
+    std::unique_ptr<std::atomic<bool>[]> active;
+    std::atomic<size_t> live;
+    std::mutex grow_mtx; // held to start a worker
 };
-} // namespace impl
\ No newline at end of file
+} // namespace impl
@@ -0,0 +1,142 @@
+/* A move-only replacement of std::function<void()> for the tasks of thread_pool.
+ * - Callables up to 'inline_size' bytes (and nothrow movable) are stored inside the object, no heap allocation.
+ * - Larger ones fall back to the heap, like std::function does.
+ * - Being move-only, it can hold move-only callables such as std::packaged_task, no shared_ptr is needed.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace impl
+{
+class unique_task
+{
+  public:
+    static constexpr size_t inline_size = 48;
+
+  private:
+    // A hand-written vtable, one static instance per callable type
+    struct ops
+    {
+        void (*invoke)(void *self);
+        void (*move)(void *dst, void *src); // move-construct 'dst' from 'src', then destroy 'src'
+        void (*destroy)(void *self);
+    };
+
+    template <class F> static constexpr bool fits_inline =
+        sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<F>;
+
+    template <class F> static F *as(void *p)
+    {
+        return std::launder(reinterpret_cast<F *>(p));
+    }
+
+    template <class F> static inline constexpr ops inline_ops = {
+        [](void *self) { (*as<F>(self))(); },
+        [](void *dst, void *src) {
+            new (dst) F(std::move(*as<F>(src)));
+            as<F>(src)->~F();
+        },
+        [](void *self) { as<F>(self)->~F(); },
+    };
+
+    // The buffer holds a 'F *' only
+    template <class F> static inline constexpr ops heap_ops = {
+        [](void *self) { (**as<F *>(self))(); },
+        [](void *dst, void *src) { new (dst) F *(*as<F *>(src)); },
+        [](void *self) { delete *as<F *>(self); },
+    };
+
+    const ops *vt;
+
+  public:
+    // A spare word which lives in the padding between 'vt' and 'buf', so it costs nothing. thread_pool stores
+    // the enqueue time of the task in it when its stats are enabled. It moves along with the task.
+    uint64_t stamp = 0;
+
+  private:
+    alignas(std::max_align_t) unsigned char buf[inline_size];
+
+    void clear()
+    {
+        if (vt != nullptr)
+        {
+            vt->destroy(buf);
+            vt = nullptr;
+        }
+    }
+
+  public:
+    unique_task() noexcept : vt(nullptr)
+    {
+    }
+
+    unique_task(std::nullptr_t) noexcept : vt(nullptr)
+    {
+    }
+
+    template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, unique_task> &&
+                                                !std::is_same_v<std::decay_t<F>, std::nullptr_t>>>
+    unique_task(F &&f)
+    {
+        using fn = std::decay_t<F>;
+        if constexpr (fits_inline<fn>)
+        {
+            new (buf) fn(std::forward<F>(f));
+            vt = &inline_ops<fn>;
+        }
+        else
+        {
+            new (buf) fn *(new fn(std::forward<F>(f)));
+            vt = &heap_ops<fn>;
+        }
+    }
+
+    unique_task(const unique_task &) = delete;
+    unique_task &operator=(const unique_task &) = delete;
+
+    unique_task(unique_task &&t) noexcept : vt(t.vt), stamp(t.stamp)
+    {
+        if (vt != nullptr)
+            vt->move(buf, t.buf), t.vt = nullptr;
+    }
+
+    unique_task &operator=(unique_task &&t) noexcept
+    {
+        if (this != &t)
+        {
+            clear();
+            vt = t.vt, stamp = t.stamp;
+            if (vt != nullptr)
+                vt->move(buf, t.buf), t.vt = nullptr;
+        }
+        return *this;
+    }
+
+    unique_task &operator=(std::nullptr_t) noexcept
+    {
+        clear();
+        return *this;
+    }
+
+    ~unique_task()
+    {
+        clear();
+    }
+
+    void operator()()
+    {
+        vt->invoke(buf);
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return vt != nullptr;
+    }
+};
+
+static_assert(sizeof(unique_task) == 64, "'stamp' should fit in the padding before 'buf'");
+} // namespace impl